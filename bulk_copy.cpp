@@ -0,0 +1,412 @@
+/****
+  * File containing code to import a host directory into a disk and export a disk to a host directory.
+  *
+  */
+
+// Dependencies
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <dirent.h>
+// Local Dependencies
+#include "filesystem.cpp"
+
+// Set namespace
+using namespace std;
+
+// Imports go through queue a block at a time, so memory used is bounded by QUEUE_CAPACITY*CHUNK_SIZE.
+// Exports are held whole in queue, so memory used is bounded by QUEUE_CAPACITY*MAX_FILE_SIZE
+#define QUEUE_CAPACITY 64
+#define CREATE_BATCH_SIZE 256
+#define CHUNK_SIZE default_geometry::block_size
+// Largest file one inode can map
+#define MAX_FILE_SIZE ((long)default_geometry::max_inode_blocks*default_geometry::block_size)
+
+struct copy_item {
+  string host_path;
+  string file_name;
+  vector<char> data;
+  // Import only: set on last chunk of a file, and error set when file could not be read (-1) or grew too large (-2)
+  int last;
+  int error;
+};
+
+// Import state of a file being written to disk
+struct import_file_state {
+  int fd;
+  long long bytes;
+};
+
+/*
+ * Bounded queue connecting two pipeline stages.
+ */
+template <typename T>
+class WorkQueue {
+private:
+  deque<T> items;
+  mutex lock;
+  condition_variable not_empty;
+  condition_variable not_full;
+  int producers;
+public:
+  WorkQueue(int producers) : producers(producers) {}
+
+  void push(T item){
+    unique_lock<mutex> guard(lock);
+    not_full.wait(guard, [this]{ return items.size() < QUEUE_CAPACITY; });
+    items.push_back(move(item));
+    not_empty.notify_one();
+  }
+
+  /*
+   * Function to mark that one producer has finished.
+   */
+  void done(){
+    unique_lock<mutex> guard(lock);
+    --producers;
+    not_empty.notify_all();
+  }
+
+  /*
+   * Function to take next item.
+   *
+   * Retval:
+   * 0 -- All producers finished and queue is empty
+   * 1 -- Item taken
+   */
+  int pop(T& item){
+    unique_lock<mutex> guard(lock);
+    not_empty.wait(guard, [this]{ return !items.empty() || producers == 0; });
+    if(items.empty()){
+      return 0;
+    }
+    item = move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return 1;
+  }
+};
+
+FileSystem fs;
+mutex fs_lock;
+
+/*
+ * Function to list regular files under a host directory, with names relative to the root.
+ */
+void walk_directory(const string& root, const string& relative, vector<struct copy_item>& files){
+  string path = relative.empty() ? root : root+"/"+relative;
+  DIR* dir = opendir(path.c_str());
+  if(dir == NULL){
+    return;
+  }
+  struct dirent* entry;
+  while((entry = readdir(dir)) != NULL){
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0){
+      continue;
+    }
+    string child = relative.empty() ? entry->d_name : relative+"/"+entry->d_name;
+    struct stat info;
+    if(stat((root+"/"+child).c_str(), &info) != 0){
+      continue;
+    }
+    if(S_ISDIR(info.st_mode)){
+      walk_directory(root, child, files);
+    }else if(S_ISREG(info.st_mode)){
+      if(child.size() >= FILE_NAME_SIZE){
+        cout<<"Skipping, name too long: "<<child<<endl;
+        continue;
+      }
+      if(info.st_size > MAX_FILE_SIZE){
+        cout<<"Skipping, larger than "<<MAX_FILE_SIZE<<" bytes: "<<child<<endl;
+        continue;
+      }
+      struct copy_item item;
+      item.host_path = root+"/"+child;
+      item.file_name = child;
+      files.push_back(item);
+    }
+  }
+  closedir(dir);
+}
+
+/*
+ * Function to check that a file name from disk stays inside the export directory.
+ *
+ * Retval:
+ * 0 -- Name is absolute or has a ".." component
+ * 1 -- Name is safe to put under export directory
+ */
+int is_safe_name(const string& name){
+  if(name.empty() || name[0] == '/'){
+    return 0;
+  }
+  for(size_t start=0;start<=name.size();){
+    size_t end = name.find('/', start);
+    if(end == string::npos){
+      end = name.size();
+    }
+    if(name.compare(start, end-start, "..") == 0){
+      return 0;
+    }
+    start = end+1;
+  }
+  return 1;
+}
+
+/*
+ * Function to read a host file and queue it in chunks of CHUNK_SIZE bytes.
+ * Last chunk queued has last set, and error set if reading failed or file has grown larger than MAX_FILE_SIZE.
+ */
+void queue_host_file(const string& path, const string& file_name, WorkQueue<struct copy_item>& queue){
+  int fd = open(path.c_str(), O_RDONLY);
+  long total = 0;
+  while(1){
+    struct copy_item item;
+    item.host_path = path;
+    item.file_name = file_name;
+    item.error = (fd < 0) ? -1 : 0;
+    if(fd >= 0){
+      item.data.resize(CHUNK_SIZE);
+      size_t done = 0;
+      while(done < item.data.size()){
+        ssize_t res = read(fd, item.data.data()+done, item.data.size()-done);
+        if(res < 0){
+          item.error = -1;
+        }
+        if(res <= 0){
+          break;
+        }
+        done += res;
+      }
+      item.data.resize(done);
+      total += done;
+      if(total > MAX_FILE_SIZE){
+        item.error = -2;
+      }
+    }
+    item.last = item.error != 0 || (int)item.data.size() < CHUNK_SIZE;
+    int last = item.last;
+    queue.push(move(item));
+    if(last){
+      break;
+    }
+  }
+  if(fd >= 0){
+    close(fd);
+  }
+}
+
+/*
+ * Function to write a whole host file, creating parent directories.
+ *
+ * Retval:
+ * -1 -- Failed to write file
+ * 0 -- File written
+ */
+int write_host_file(const string& path, const vector<char>& data){
+  for(size_t pos=path.find('/', 1);pos!=string::npos;pos=path.find('/', pos+1)){
+    mkdir(path.substr(0, pos).c_str(), 0777);
+  }
+  int fd = open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0666);
+  if(fd < 0){
+    return -1;
+  }
+  size_t done = 0;
+  while(done < data.size()){
+    ssize_t res = write(fd, data.data()+done, data.size()-done);
+    if(res <= 0){
+      break;
+    }
+    done += res;
+  }
+  close(fd);
+  return done == data.size() ? 0 : -1;
+}
+
+/*
+ * Function to import host directory into mounted disk.
+ * Stages: allocate files in batches -> read host files (threads) -> write to disk.
+ */
+int import_directory(const string& root, int thread_count){
+  vector<struct copy_item> files;
+  walk_directory(root, "", files);
+
+  WorkQueue<int> read_queue(1);
+  WorkQueue<struct copy_item> write_queue(thread_count);
+
+  // Allocation stage
+  thread allocator([&]{
+    for(size_t start=0;start<files.size();start+=CREATE_BATCH_SIZE){
+      int count = min((size_t)CREATE_BATCH_SIZE, files.size()-start);
+      vector<char*> names(count);
+      vector<int> results(count);
+      for(int i=0;i<count;++i){
+        names[i] = (char*)files[start+i].file_name.c_str();
+      }
+      {
+        lock_guard<mutex> guard(fs_lock);
+        if(fs.add_files_to_disk(names.data(), count, results.data()) < count){
+          // Fall back to one at a time so other files in batch are still created
+          for(int i=0;i<count;++i){
+            results[i] = fs.add_file_to_disk(names[i]);
+          }
+        }
+      }
+      for(int i=0;i<count;++i){
+        if(results[i] == 1){
+          read_queue.push(start+i);
+        }else{
+          cout<<"Failed to create: "<<names[i]<<endl;
+        }
+      }
+    }
+    read_queue.done();
+  });
+
+  // Read stage; each reader queues one file at a time, so chunks of a file arrive in order
+  vector<thread> readers;
+  for(int t=0;t<thread_count;++t){
+    readers.push_back(thread([&]{
+      int index;
+      while(read_queue.pop(index)){
+        queue_host_file(files[index].host_path, files[index].file_name, write_queue);
+      }
+      write_queue.done();
+    }));
+  }
+
+  // Write stage; a file is open from its first chunk to its last, and fd is -1 once file has been dropped
+  int failed = 0;
+  int imported = 0;
+  long long bytes = 0;
+  map<string, struct import_file_state> open_files;
+  struct copy_item item;
+  while(write_queue.pop(item)){
+    lock_guard<mutex> guard(fs_lock);
+    char* name = (char*)item.file_name.c_str();
+    if(open_files.find(item.file_name) == open_files.end()){
+      struct import_file_state state = {fs.open_file(name, 3), 0};
+      open_files[item.file_name] = state;
+    }
+    struct import_file_state& state = open_files[item.file_name];
+    int drop = 0;
+    if(item.error == -2){
+      cout<<"Skipping, larger than "<<MAX_FILE_SIZE<<" bytes: "<<item.host_path<<endl;
+      drop = 1;
+    }else if(item.error == -1){
+      cout<<"Failed to read: "<<item.host_path<<endl;
+      drop = 1;
+    }else if(state.fd >= 0){
+      int res = fs.append_to_file(state.fd, item.data.data(), item.data.size());
+      state.bytes += res;
+      if(res < (int)item.data.size()){
+        // Files never exceed MAX_FILE_SIZE here, so a short append means disk is full
+        cout<<"Disk full, skipping: "<<item.file_name<<endl;
+        failed = 1;
+        drop = 1;
+      }
+    }
+    if(drop && state.fd >= 0){
+      fs.close_file(state.fd);
+      fs.remove_file_from_disk(name);
+      state.fd = -1;
+    }
+    if(item.last){
+      if(state.fd >= 0){
+        fs.close_file(state.fd);
+        bytes += state.bytes;
+        ++imported;
+      }
+      open_files.erase(item.file_name);
+    }
+  }
+  allocator.join();
+  for(int t=0;t<thread_count;++t){
+    readers[t].join();
+  }
+  cout<<"Imported "<<imported<<" files, "<<bytes<<" bytes\n";
+  return failed ? -1 : 0;
+}
+
+/*
+ * Function to export mounted disk into host directory.
+ * Stages: read files from disk -> write host files (threads).
+ */
+int export_directory(const string& root, int thread_count){
+  vector<struct file_info> file_list = fs.get_file_list();
+  WorkQueue<struct copy_item> write_queue(1);
+
+  // Write stage
+  atomic<int> failed(0);
+  vector<thread> writers;
+  for(int t=0;t<thread_count;++t){
+    writers.push_back(thread([&]{
+      struct copy_item item;
+      while(write_queue.pop(item)){
+        if(write_host_file(item.host_path, item.data) < 0){
+          cout<<"Failed to write: "<<item.host_path<<endl;
+          failed = 1;
+        }
+      }
+    }));
+  }
+
+  // Read stage
+  long long bytes = 0;
+  int exported = 0;
+  for(int i=0;i<file_list.size();++i){
+    struct copy_item item;
+    item.file_name = file_list[i].file_name;
+    if(!is_safe_name(item.file_name)){
+      cout<<"Skipping, name leaves export directory: "<<item.file_name<<endl;
+      failed = 1;
+      continue;
+    }
+    item.host_path = root+"/"+item.file_name;
+    {
+      lock_guard<mutex> guard(fs_lock);
+      int fd = fs.open_file(file_list[i].file_name, 1);
+      item.data.resize(fs.get_file_size(fd));
+      fs.read_from_file(fd, item.data.data(), item.data.size());
+      fs.close_file(fd);
+    }
+    bytes += item.data.size();
+    ++exported;
+    write_queue.push(move(item));
+  }
+  write_queue.done();
+  for(int t=0;t<thread_count;++t){
+    writers[t].join();
+  }
+  cout<<"Exported "<<exported<<" files, "<<bytes<<" bytes\n";
+  return failed ? -1 : 0;
+}
+
+int main(int argc, char** argv){
+  if(argc < 4 || (strcmp(argv[1], "import") != 0 && strcmp(argv[1], "export") != 0)){
+    cout<<"Usage: "<<argv[0]<<" import|export <disk> <host_dir> [threads]\n";
+    return 1;
+  }
+  int import = strcmp(argv[1], "import") == 0;
+  char* disk_name = argv[2];
+  string root = argv[3];
+  int thread_count = (argc > 4) ? atoi(argv[4]) : thread::hardware_concurrency();
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+
+  if(import && fs.create_disk(disk_name) < 0){
+    cout<<"Failed to create disk\n";
+    return 1;
+  }
+  if(fs.mount_disk(disk_name) < 0){
+    cout<<"Failed to mount disk\n";
+    return 1;
+  }
+  int res = import ? import_directory(root, thread_count) : export_directory(root, thread_count);
+  fs.unmount_disk();
+  return res < 0 ? 1 : 0;
+}
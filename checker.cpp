@@ -0,0 +1,378 @@
+/****
+  * File containing offline checker for disk images.
+  * Cross-checks super block, inodes and data blocks with several threads, and optionally repairs the image.
+  *
+  */
+
+#ifndef CHECKER_CPP
+#define CHECKER_CPP
+
+// Dependencies
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <functional>
+// Local Dependencies
+#include "filesystem.cpp"
+
+// Set namespace
+using namespace std;
+
+// Exit codes, as used by fsck(8)
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+typedef default_geometry Geometry;
+typedef FileSystem Layout;
+
+// Problems found for one file
+#define FILE_OK 0
+#define FILE_BAD_ENTRY 1
+#define FILE_BAD_INODE 2
+
+struct check_state {
+  char* image;
+  int layout;
+  // Checkpoint slot read in log layout, and where its file list starts
+  int slot;
+  char* file_list;
+  int thread_count;
+  vector<struct file_info> files;
+  vector<int> file_status;
+  vector<int> imap;
+  // Claims on each inode and data block, and lowest file index claiming it
+  vector<atomic<int> > inode_claims;
+  vector<atomic<int> > block_claims;
+  vector<atomic<int> > block_owner;
+  // Counters
+  atomic<int> bad_entries;
+  atomic<int> bad_inodes;
+  atomic<int> orphan_inodes;
+  atomic<int> leaked_blocks;
+  atomic<int> zero_headed_blocks;
+  int bad_names;
+  int shared_inodes;
+  int double_blocks;
+  int used_blocks;
+};
+
+/*
+ * Function to split [0, count) into one range per thread and run body on each.
+ */
+void run_parallel(int count, int thread_count, function<void(int, int)> body){
+  vector<thread> threads;
+  int chunk = (count+thread_count-1)/thread_count;
+  for(int start=0;start<count;start+=chunk){
+    threads.push_back(thread(body, start, min(count, start+chunk)));
+  }
+  for(int i=0;i<threads.size();++i){
+    threads[i].join();
+  }
+}
+
+char* block_ptr(struct check_state& state, int pos){
+  return state.image+Geometry::offset(pos);
+}
+
+int first_int(struct check_state& state, int pos){
+  int value;
+  memcpy(&value, block_ptr(state, pos), sizeof(value));
+  return value;
+}
+
+int is_data_block(struct check_state& state, int pos){
+  if(pos < Geometry::block_start || pos > Geometry::block_end){
+    return 0;
+  }
+  // Log layout only writes whole segments
+  return state.layout != LAYOUT_LOG || (pos-Geometry::block_start)/SEGMENT_BLOCKS < Layout::segment_count;
+}
+
+/*
+ * Function to get block holding a file's inode.
+ *
+ * Retval:
+ * 0 -- Inode position is not valid
+ * Non negative integer -- Block position
+ */
+int inode_block(struct check_state& state, int inode_pos){
+  if(inode_pos < Geometry::inode_start || inode_pos > Geometry::inode_end){
+    return 0;
+  }
+  if(state.layout != LAYOUT_LOG){
+    return inode_pos;
+  }
+  int pos = state.imap[inode_pos-Geometry::inode_start];
+  return is_data_block(state, pos) ? pos : 0;
+}
+
+/*
+ * Function to record a claim by file index on a block, keeping the lowest claiming file as owner.
+ */
+void claim_block(struct check_state& state, int pos, int file_index){
+  int index = pos-Geometry::block_start;
+  state.block_claims[index].fetch_add(1);
+  int owner = state.block_owner[index];
+  while((owner < 0 || file_index < owner) && !state.block_owner[index].compare_exchange_weak(owner, file_index));
+}
+
+/*
+ * Function to check file list in super block: names must be terminated and unique, and inodes valid and unshared.
+ *
+ * Retval:
+ * -1 -- Super block is unreadable
+ * 0 -- File list read
+ */
+int check_super_block(struct check_state& state){
+  int file_count;
+  memcpy(&file_count, state.file_list, sizeof(file_count));
+  long limit = ((long)(state.layout == LAYOUT_LOG ? Layout::list_blocks : Geometry::super_end)<<Geometry::block_shift)-sizeof(int);
+  if(file_count < 0 || file_count > Layout::inode_count || (long)file_count*sizeof(struct file_info) > limit){
+    cout<<"Super block: bad file count "<<file_count<<endl;
+    return -1;
+  }
+  state.files.resize(file_count);
+  memcpy(state.files.data(), state.file_list+sizeof(int), file_count*sizeof(struct file_info));
+  state.file_status.assign(file_count, FILE_OK);
+  unordered_set<string> names;
+  for(int i=0;i<file_count;++i){
+    struct file_info& file = state.files[i];
+    if(memchr(file.file_name, 0, FILE_NAME_SIZE) == NULL || file.file_name[0] == 0){
+      file.file_name[FILE_NAME_SIZE-1] = 0;
+      cout<<"File "<<i<<": bad name\n";
+      state.file_status[i] = FILE_BAD_INODE;
+      ++state.bad_names;
+      continue;
+    }
+    if(!names.insert(file.file_name).second){
+      cout<<"File "<<file.file_name<<": name repeated\n";
+      state.file_status[i] = FILE_BAD_INODE;
+      ++state.bad_names;
+      continue;
+    }
+    if(inode_block(state, file.inode_pos) == 0){
+      cout<<"File "<<file.file_name<<": bad inode "<<file.inode_pos<<endl;
+      state.file_status[i] = FILE_BAD_INODE;
+      ++state.bad_inodes;
+      continue;
+    }
+    if(state.inode_claims[file.inode_pos-Geometry::inode_start]++ > 0){
+      cout<<"File "<<file.file_name<<": inode "<<file.inode_pos<<" shared with another file\n";
+      state.file_status[i] = FILE_BAD_INODE;
+      ++state.shared_inodes;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Function to check inodes of files in [start, end) and claim their blocks.
+ */
+void check_inodes(struct check_state& state, int start, int end){
+  for(int i=start;i<end;++i){
+    if(state.file_status[i] != FILE_OK){
+      continue;
+    }
+    struct file_info& file = state.files[i];
+    int pos = inode_block(state, file.inode_pos);
+    char* inode = block_ptr(state, pos);
+    int block_count;
+    memcpy(&block_count, inode, sizeof(block_count));
+    if(block_count < 1 || block_count > Geometry::max_inode_blocks){
+      cout<<"File "<<file.file_name<<": bad block count "<<block_count<<endl;
+      state.file_status[i] = FILE_BAD_INODE;
+      // Leave inode to be found as an orphan
+      --state.inode_claims[file.inode_pos-Geometry::inode_start];
+      ++state.bad_inodes;
+      continue;
+    }
+    if(state.layout == LAYOUT_LOG){
+      claim_block(state, pos, i);
+    }
+    struct inode_data* map = (struct inode_data*)(inode+sizeof(int));
+    for(int j=0;j<block_count;++j){
+      if((map[j].block_pos != 0 && !is_data_block(state, map[j].block_pos)) || map[j].block_filled < 0 || map[j].block_filled > Geometry::block_size){
+        cout<<"File "<<file.file_name<<": bad entry "<<j<<" (block "<<map[j].block_pos<<", filled "<<map[j].block_filled<<")\n";
+        state.file_status[i] = FILE_BAD_ENTRY;
+        ++state.bad_entries;
+        continue;
+      }
+      if(map[j].block_pos != 0){
+        claim_block(state, map[j].block_pos, i);
+      }
+    }
+  }
+}
+
+/*
+ * Function to find inodes in [start, end) of inode region which are in use but belong to no file.
+ */
+void check_orphans(struct check_state& state, int start, int end){
+  for(int k=start;k<end;++k){
+    if(state.inode_claims[k] > 0){
+      continue;
+    }
+    int in_use = (state.layout == LAYOUT_LOG) ? state.imap[k] != 0 : first_int(state, Geometry::inode_start+k) != 0;
+    if(in_use){
+      ++state.orphan_inodes;
+    }
+  }
+}
+
+/*
+ * Function to find data blocks in [start, end) marked used without an owner, and owned blocks
+ * which look free to allocators going by first int.
+ */
+void check_blocks(struct check_state& state, int start, int end){
+  for(int k=start;k<end;++k){
+    int used = first_int(state, Geometry::block_start+k) != 0;
+    if(state.block_claims[k] == 0 && used){
+      ++state.leaked_blocks;
+    }else if(state.block_claims[k] > 0 && !used){
+      ++state.zero_headed_blocks;
+    }
+  }
+}
+
+/*
+ * Function to repair image: drop bad files, fix bad entries, give second claimants of a block their own copy
+ * (a hole in log layout), and free orphan inodes and leaked blocks.
+ */
+void repair(struct check_state& state){
+  int empty = 0;
+  // Fix entries and multiply claimed blocks
+  int next_free = 0;
+  for(int i=0;i<state.files.size();++i){
+    if(state.file_status[i] == FILE_BAD_INODE){
+      continue;
+    }
+    char* inode = block_ptr(state, inode_block(state, state.files[i].inode_pos));
+    int block_count;
+    memcpy(&block_count, inode, sizeof(block_count));
+    struct inode_data* map = (struct inode_data*)(inode+sizeof(int));
+    for(int j=0;j<block_count;++j){
+      if((map[j].block_pos != 0 && !is_data_block(state, map[j].block_pos)) || map[j].block_filled < 0 || map[j].block_filled > Geometry::block_size){
+        map[j].block_pos = 0;
+        map[j].block_filled = max(0, min(map[j].block_filled, Geometry::block_size));
+        continue;
+      }
+      int index = map[j].block_pos-Geometry::block_start;
+      if(map[j].block_pos == 0 || state.block_owner[index] == i){
+        continue;
+      }
+      // Find a block nobody claims
+      while(state.layout != LAYOUT_LOG && next_free < state.block_claims.size() && state.block_claims[next_free] > 0){
+        ++next_free;
+      }
+      if(state.layout == LAYOUT_LOG || next_free == state.block_claims.size()){
+        map[j].block_pos = 0;
+        continue;
+      }
+      memcpy(block_ptr(state, Geometry::block_start+next_free), block_ptr(state, map[j].block_pos), Geometry::block_size);
+      state.block_claims[next_free] = 1;
+      state.block_owner[next_free] = i;
+      map[j].block_pos = Geometry::block_start+next_free;
+    }
+  }
+  // Free orphan inodes and leaked blocks. Heads already zero are left alone, since writing them would
+  // allocate pages of a sparse image.
+  for(int k=0;k<Layout::inode_count;++k){
+    if(state.inode_claims[k] > 0){
+      continue;
+    }
+    if(state.layout == LAYOUT_LOG){
+      state.imap[k] = 0;
+    }else if(first_int(state, Geometry::inode_start+k) != 0){
+      memcpy(block_ptr(state, Geometry::inode_start+k), &empty, sizeof(empty));
+    }
+  }
+  if(state.layout == LAYOUT_LOG){
+    memcpy(block_ptr(state, Layout::imap_slot_start(state.slot)), state.imap.data(), state.imap.size()*sizeof(int));
+  }else{
+    for(int k=0;k<state.block_claims.size();++k){
+      if(state.block_claims[k] == 0 && first_int(state, Geometry::block_start+k) != 0){
+        memcpy(block_ptr(state, Geometry::block_start+k), &empty, sizeof(empty));
+      }
+    }
+  }
+  // Drop bad files from super block
+  vector<struct file_info> remaining;
+  for(int i=0;i<state.files.size();++i){
+    if(state.file_status[i] != FILE_BAD_INODE){
+      remaining.push_back(state.files[i]);
+    }
+  }
+  int file_count = remaining.size();
+  memcpy(state.file_list, &file_count, sizeof(file_count));
+  memcpy(state.file_list+sizeof(int), remaining.data(), file_count*sizeof(struct file_info));
+}
+
+/*
+ * Function to check a mapped image, and repair it if asked and problems were found.
+ * Caller sets image and thread_count; the rest of state is filled in with what was found.
+ *
+ * Retval:
+ * FSCK_OK -- Image is clean
+ * FSCK_CORRECTED -- Problems were found and repaired
+ * FSCK_UNCORRECTED -- Problems were found and left
+ */
+int check_image(struct check_state& state, int do_repair){
+  // Read layout, from last checkpoint in log layout
+  struct log_header headers[CHECKPOINT_SLOTS];
+  for(int slot=0;slot<CHECKPOINT_SLOTS;++slot){
+    memcpy(&headers[slot], state.image+Layout::header_offset(slot), sizeof(headers[slot]));
+  }
+  state.slot = Layout::newest_checkpoint(headers);
+  state.layout = (state.slot < 0) ? LAYOUT_BLOCK : LAYOUT_LOG;
+  state.file_list = state.image;
+  state.files.clear();
+  state.imap.clear();
+  if(state.layout == LAYOUT_LOG){
+    state.file_list = block_ptr(state, Layout::list_start(state.slot));
+    state.imap.resize(Layout::inode_count);
+    memcpy(state.imap.data(), block_ptr(state, Layout::imap_slot_start(state.slot)), state.imap.size()*sizeof(int));
+  }
+  state.inode_claims = vector<atomic<int> >(Layout::inode_count);
+  state.block_claims = vector<atomic<int> >(Geometry::block_end-Geometry::block_start+1);
+  state.block_owner = vector<atomic<int> >(state.block_claims.size());
+  for(int k=0;k<state.block_owner.size();++k){
+    state.block_owner[k] = -1;
+  }
+  state.bad_entries = 0;
+  state.bad_inodes = 0;
+  state.orphan_inodes = 0;
+  state.leaked_blocks = 0;
+  state.zero_headed_blocks = 0;
+  state.bad_names = 0;
+  state.shared_inodes = 0;
+  state.double_blocks = 0;
+  state.used_blocks = 0;
+
+  // Check file list, then inodes of files, then whole inode and data regions
+  if(check_super_block(state) < 0){
+    return FSCK_UNCORRECTED;
+  }
+  run_parallel(state.files.size(), state.thread_count, [&state](int from, int to){ check_inodes(state, from, to); });
+  run_parallel(Layout::inode_count, state.thread_count, [&state](int from, int to){ check_orphans(state, from, to); });
+  if(state.layout != LAYOUT_LOG){
+    // Dead blocks in a log keep their old contents, so only block layout can be checked for leaks
+    run_parallel(state.block_claims.size(), state.thread_count, [&state](int from, int to){ check_blocks(state, from, to); });
+  }
+  for(int k=0;k<state.block_claims.size();++k){
+    if(state.block_claims[k] > 1){
+      ++state.double_blocks;
+    }
+    state.used_blocks += state.block_claims[k] > 0;
+  }
+
+  int problems = state.bad_names+state.shared_inodes+state.bad_inodes+state.bad_entries+state.double_blocks+state.orphan_inodes+state.leaked_blocks;
+  if(problems > 0 && do_repair){
+    repair(state);
+    return FSCK_CORRECTED;
+  }
+  return problems > 0 ? FSCK_UNCORRECTED : FSCK_OK;
+}
+
+#endif
@@ -19,7 +19,7 @@ FileSystem fs;
  */
 void file_REPL(){
   // Display menu
-  cout<<"1) Create file\n2) Open file\n3) Read file\n4) Write file\n5) Append file\n6) Close file\n7) Delete file\n8) List all files\n9) List opened files\n10) Unmount\n";
+  cout<<"1) Create file\n2) Open file\n3) Read file\n4) Write file\n5) Append file\n6) Close file\n7) Delete file\n8) List all files\n9) List opened files\n10) Unmount\n11) Show stats\n12) Start trace\n13) Stop trace\n14) Sync file\n15) Search files\n16) Export file\n17) Import file\n";
   while(1){
     int inp;
     cin>>inp;
@@ -145,6 +145,92 @@ void file_REPL(){
         cout<<"Umount successful\n";
       }
       break;
+    }else if(inp == 11){ // Display stats
+      fs.display_stats();
+    }else if(inp == 12){ // Start trace
+      char trace_name[FILE_NAME_SIZE];
+      cout<<"Enter trace filename: ";
+      cin>>trace_name;
+      int res = fs.start_trace(trace_name);
+      if(res == 0){
+        cout<<"Tracing started\n";
+      }else{
+        cout<<"Failed to start trace\n";
+      }
+    }else if(inp == 13){ // Stop trace
+      int res = fs.stop_trace();
+      if(res == 0){
+        cout<<"Tracing stopped\n";
+      }else{
+        cout<<"Tracing was not on\n";
+      }
+    }else if(inp == 14){ // Sync file
+      int fd;
+      cout<<"Enter file descriptor: ";
+      cin>>fd;
+      int res = fs.fsync(fd);
+      if(res == 0){
+        cout<<"File synced\n";
+      }else if(res == -1){
+        cout<<"No file open with given file descriptor\n";
+      }else{
+        cout<<"Failed to sync file\n";
+      }
+    }else if(inp == 15){ // Search files
+      char pattern[BLOCK_SIZE];
+      cout<<"Enter text to search for: ";
+      cin>>pattern;
+      vector<struct search_result> res = fs.search(pattern);
+      for(int i=0;i<res.size();++i){
+        cout<<res[i].file_name<<":";
+        for(int j=0;j<res[i].offsets.size();++j){
+          cout<<" "<<res[i].offsets[j];
+        }
+        cout<<endl;
+      }
+      if(res.empty()){
+        cout<<"No matches\n";
+      }
+    }else if(inp == 16){ // Export file
+      int fd;
+      char host_name[PATH_MAX];
+      cout<<"Enter file descriptor: ";
+      cin>>fd;
+      cout<<"Enter host file path: ";
+      cin>>host_name;
+      int out_fd = open(host_name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if(out_fd < 0){
+        cout<<"Failed to open host file\n";
+        continue;
+      }
+      long res = fs.export_file(fd, out_fd);
+      close(out_fd);
+      if(res < 0){
+        cout<<"No file open with given file descriptor\n";
+      }else{
+        cout<<"Exported "<<res<<" bytes\n";
+      }
+    }else if(inp == 17){ // Import file
+      char host_name[PATH_MAX];
+      char file_name[FILE_NAME_SIZE];
+      cout<<"Enter host file path: ";
+      cin>>host_name;
+      cout<<"Enter filename: ";
+      cin>>file_name;
+      int in_fd = open(host_name, O_RDONLY);
+      if(in_fd < 0){
+        cout<<"Failed to open host file\n";
+        continue;
+      }
+      long res = fs.import_file(in_fd, file_name);
+      close(in_fd);
+      if(res == -2){
+        cout<<"File already exists\n";
+      }else if(res == -1){
+        cout<<"Memory not available\n";
+      }else{
+        cout<<"Imported "<<res<<" bytes\n";
+      }
     }else{
       cout<<"Not recognised\n";
     }
@@ -165,7 +251,11 @@ void disk_REPL(){
       char disk_name[FILE_NAME_SIZE];
       cout<<"Enter disk name: ";
       cin>>disk_name;
-      int res = fs.create_disk(disk_name);
+      // Get on disk layout
+      int layout;
+      cout<<"Enter layout (0 - update in place, 1 - log structured): ";
+      cin>>layout;
+      int res = fs.create_disk(disk_name, layout);
       if(res == 0){
         cout<<"Disk exists\n";
       }else if(res == 1){
@@ -178,7 +268,11 @@ void disk_REPL(){
       char disk_name[FILE_NAME_SIZE];
       cout<<"Enter disk name: ";
       cin>>disk_name;
-      int res = fs.mount_disk(disk_name);
+      // Get durability mode
+      int mode;
+      cout<<"Enter durability (0 - none, 1 - periodic, 2 - on close, 3 - every operation): ";
+      cin>>mode;
+      int res = fs.mount_disk(disk_name, mode);
       if(res == 0){
         cout<<"Disk mounted\n";
       }else{
@@ -0,0 +1,373 @@
+/****
+  * File containing client library for file system server.
+  *
+  */
+
+#ifndef CLIENT_CPP
+#define CLIENT_CPP
+
+// Dependencies
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <vector>
+#include <map>
+// Local Dependencies
+#include "protocol.cpp"
+
+// Set namespace
+using namespace std;
+
+#ifndef FILE_NAME_SIZE
+#define FILE_NAME_SIZE 100
+#endif
+#define SHM_THRESHOLD 64*1024
+
+struct client_response {
+  int status;
+  vector<char> data;
+};
+
+class FsClient {
+private:
+  int sock;
+  unsigned int next_req_id;
+  vector<char> out;
+  vector<char> in;
+  map<unsigned int, struct client_response> ready;
+  // Shared memory for large payloads. Each request in flight holds a range until its response arrives.
+  char* shm;
+  long long shm_size;
+  // Ranges in use: offset -> length, and offset of range held by each request
+  map<long long, int> shm_ranges;
+  map<unsigned int, long long> shm_requests;
+  // Payloads of SHM_THRESHOLD bytes or more sent inline because shared memory had no room for them
+  long long shm_fallbacks;
+  // Shared memory fd received from server, waiting to be mapped
+  int shm_fd;
+  // Read requests placed in shared memory: req_id -> (offset, destination)
+  map<unsigned int, pair<long long, char*> > shm_reads;
+
+  int send_all(){
+    size_t sent = 0;
+    while(sent < out.size()){
+      ssize_t res = send(sock, &out[sent], out.size()-sent, 0);
+      if(res < 0){
+        if(errno == EINTR){
+          continue;
+        }
+        return -1;
+      }
+      sent += res;
+    }
+    out.clear();
+    return 0;
+  }
+
+  /*
+   * Function to reserve space in shared memory for a payload, in the first gap between ranges in use that fits.
+   *
+   * Retval:
+   * -1 -- Payload should be sent inline
+   * Non negative integer -- Offset in shared memory
+   */
+  long long reserve_shm(unsigned int req_id, int length){
+    if(shm == NULL || length < SHM_THRESHOLD){
+      return -1;
+    }
+    long long offset = 0;
+    for(map<long long, int>::iterator it=shm_ranges.begin();it!=shm_ranges.end();++it){
+      if(it->first-offset >= length){
+        break;
+      }
+      offset = it->first+it->second;
+    }
+    if(offset+length > shm_size){
+      ++shm_fallbacks;
+      return -1;
+    }
+    shm_ranges[offset] = length;
+    shm_requests[req_id] = offset;
+    return offset;
+  }
+
+  /*
+   * Function to read one response from socket into ready list.
+   *
+   * Retval:
+   * -1 -- Connection failed
+   * 0 -- Response received
+   */
+  int receive_one(){
+    while(1){
+      if(in.size() >= sizeof(struct response_header)){
+        struct response_header header;
+        memcpy(&header, in.data(), sizeof(header));
+        int inline_len = shm_reads.count(header.req_id) ? 0 : header.length;
+        if(in.size() >= sizeof(header)+inline_len){
+          struct client_response res;
+          res.status = header.status;
+          res.data.assign(in.begin()+sizeof(header), in.begin()+sizeof(header)+inline_len);
+          in.erase(in.begin(), in.begin()+sizeof(header)+inline_len);
+          map<unsigned int, pair<long long, char*> >::iterator it = shm_reads.find(header.req_id);
+          if(it != shm_reads.end()){
+            if(header.status > 0){
+              memcpy(it->second.second, shm+it->second.first, header.status);
+            }
+            shm_reads.erase(it);
+          }
+          // Release shared memory range of request
+          map<unsigned int, long long>::iterator range = shm_requests.find(header.req_id);
+          if(range != shm_requests.end()){
+            shm_ranges.erase(range->second);
+            shm_requests.erase(range);
+          }
+          ready[header.req_id] = res;
+          return 0;
+        }
+      }
+      char chunk[64*1024];
+      struct iovec iov;
+      iov.iov_base = chunk;
+      iov.iov_len = sizeof(chunk);
+      char control[CMSG_SPACE(sizeof(int))];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+      if(res < 0 && errno == EINTR){
+        continue;
+      }
+      if(res <= 0){
+        return -1;
+      }
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+        if(shm_fd >= 0){
+          close(shm_fd);
+        }
+        memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+      }
+      in.insert(in.end(), chunk, chunk+res);
+    }
+  }
+public:
+  FsClient(){
+    sock = -1;
+    next_req_id = 1;
+    shm = NULL;
+    shm_size = 0;
+    shm_fallbacks = 0;
+    shm_fd = -1;
+  }
+
+  ~FsClient(){
+    disconnect();
+  }
+
+  /*
+   * Function to connect to server.
+   *
+   * Retval:
+   * -1 -- Failed to connect
+   * 0 -- Connected
+   */
+  int connect_server(const char* socket_path){
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+      close(sock);
+      sock = -1;
+      return -1;
+    }
+    return 0;
+  }
+
+  void disconnect(){
+    if(sock >= 0){
+      close(sock);
+      sock = -1;
+    }
+    if(shm != NULL){
+      munmap(shm, shm_size);
+      shm = NULL;
+    }
+    if(shm_fd >= 0){
+      close(shm_fd);
+      shm_fd = -1;
+    }
+  }
+
+  /*
+   * Function to get a memory region shared with server for payloads of SHM_THRESHOLD bytes or more.
+   * Server creates the region and passes its fd back with the response.
+   *
+   * Retval:
+   * -1 -- Failed to share memory
+   * 0 -- Memory shared
+   */
+  int attach_shm(long long size){
+    if(size <= 0 || size > MAX_SHM_SIZE || !shm_requests.empty()){
+      return -1;
+    }
+    int res = call(REQ_ATTACH_SHM, -1, size, NULL, NULL, 0);
+    if(res < 0 || shm_fd < 0){
+      return -1;
+    }
+    char* region = (char*)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    shm_fd = -1;
+    // Server has dropped any older region, so drop it here too
+    if(shm != NULL){
+      munmap(shm, shm_size);
+      shm = NULL;
+    }
+    if(region == MAP_FAILED){
+      return -1;
+    }
+    shm = region;
+    shm_size = size;
+    return 0;
+  }
+
+  /*
+   * Function to get number of large payloads sent inline because shared memory had no room for them.
+   */
+  long long get_shm_fallbacks(){
+    return shm_fallbacks;
+  }
+
+  /*
+   * Function to queue a request without waiting for response.
+   * For reads, data is the destination buffer and length its size.
+   *
+   * Retval:
+   * Request id to pass to wait
+   */
+  unsigned int submit(int op, int fd, int arg, const char* file_name, const char* data, int length){
+    struct request_header header;
+    header.req_id = next_req_id++;
+    header.op = op;
+    header.flags = 0;
+    header.name_len = (file_name == NULL) ? 0 : strlen(file_name);
+    header.fd = fd;
+    header.arg = arg;
+    header.length = length;
+    header.shm_offset = 0;
+    int inline_data = (op == REQ_WRITE || op == REQ_APPEND);
+    long long offset = (op == REQ_READ || inline_data) ? reserve_shm(header.req_id, length) : -1;
+    if(offset >= 0){
+      header.flags |= FLAG_SHM;
+      header.shm_offset = offset;
+      if(inline_data){
+        memcpy(shm+offset, data, length);
+      }else{
+        shm_reads[header.req_id] = make_pair(offset, (char*)data);
+      }
+      inline_data = 0;
+    }
+    out.insert(out.end(), (char*)&header, (char*)&header+sizeof(header));
+    out.insert(out.end(), file_name, file_name+header.name_len);
+    if(inline_data){
+      out.insert(out.end(), data, data+length);
+    }
+    return header.req_id;
+  }
+
+  /*
+   * Function to send queued requests.
+   *
+   * Retval:
+   * -1 -- Connection failed
+   * 0 -- Requests sent
+   */
+  int flush(){
+    return send_all();
+  }
+
+  /*
+   * Function to wait for response to a request, sending queued requests first.
+   * For reads not placed in shared memory, response data is in res.data.
+   *
+   * Retval:
+   * -1 -- Connection failed
+   * 0 -- Response received
+   */
+  int wait(unsigned int req_id, struct client_response& res){
+    if(send_all() < 0){
+      return -1;
+    }
+    while(ready.find(req_id) == ready.end()){
+      if(receive_one() < 0){
+        return -1;
+      }
+    }
+    res = ready[req_id];
+    ready.erase(req_id);
+    return 0;
+  }
+
+  /*
+   * Function to send a request and wait for its status.
+   *
+   * Retval:
+   * -4 -- Connection failed
+   * Otherwise status returned by server
+   */
+  int call(int op, int fd, int arg, const char* file_name, const char* data, int length){
+    unsigned int req_id = submit(op, fd, arg, file_name, data, length);
+    struct client_response res;
+    if(wait(req_id, res) < 0){
+      return -4;
+    }
+    if(op == REQ_READ && res.status > 0 && !res.data.empty()){
+      memcpy((char*)data, res.data.data(), res.status);
+    }
+    return res.status;
+  }
+
+  int add_file_to_disk(const char* file_name){
+    return call(REQ_CREATE, -1, 0, file_name, NULL, 0);
+  }
+
+  int remove_file_from_disk(const char* file_name){
+    return call(REQ_DELETE, -1, 0, file_name, NULL, 0);
+  }
+
+  int open_file(const char* file_name, int mode){
+    return call(REQ_OPEN, -1, mode, file_name, NULL, 0);
+  }
+
+  int close_file(int fd){
+    return call(REQ_CLOSE, fd, 0, NULL, NULL, 0);
+  }
+
+  int get_file_size(int fd){
+    return call(REQ_FILE_SIZE, fd, 0, NULL, NULL, 0);
+  }
+
+  int read_from_file(int fd, char* buffer, int buffer_size){
+    return call(REQ_READ, fd, 0, NULL, buffer, buffer_size);
+  }
+
+  int write_to_file(int fd, const char* buffer, int buffer_size){
+    return call(REQ_WRITE, fd, 0, NULL, buffer, buffer_size);
+  }
+
+  int append_to_file(int fd, const char* buffer, int buffer_size){
+    return call(REQ_APPEND, fd, 0, NULL, buffer, buffer_size);
+  }
+};
+
+#endif
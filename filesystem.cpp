@@ -3,6 +3,9 @@
   *
   */
 
+#ifndef FILESYSTEM_CPP
+#define FILESYSTEM_CPP
+
 // Dependencies
 #include <iostream>
 #include <stdio.h>
@@ -14,6 +17,21 @@
 #include <fcntl.h>
 #include <vector>
 #include <utility>
+#include <climits>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <unordered_set>
+#include <algorithm>
+#include <map>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // Set namespace
 using namespace std;
@@ -27,6 +45,20 @@ using namespace std;
 #define INODE_END 28000
 #define BLOCK_START 28001
 #define BLOCK_END 128000
+#define STATS_SHARDS 16
+#define STATS_BUCKETS 64
+#define TRACE_MAGIC 0x4e465355
+#define INODE_CACHE_SIZE 256
+#define FLUSH_INTERVAL_MS 1000
+#define ALLOC_GROUPS 16
+#define LOG_MAGIC 0x4e46534c
+#define SEGMENT_BLOCKS 256
+#define LOG_RESERVE_SEGMENTS 2
+#define CLEAN_LOW_SEGMENTS 8
+#define CHECKPOINT_BLOCKS 4096
+#define CHECKPOINT_SLOTS 2
+#define HEADER_SLOT_BYTES 512
+#define CLEANER_INTERVAL_MS 100
 
 
 struct file_info {
@@ -40,6 +72,7 @@ struct open_file_info {
   int fd;
   int mode;
   int write_status;
+  int cache_slot;
 };
 
 struct inode_data {
@@ -47,258 +80,2688 @@ struct inode_data {
   int block_filled;
 };
 
-class FileSystem {
+// Cached copy of an inode. Block map lives in inode_arena at slot*max_inode_blocks.
+struct inode_cache_entry {
+  int inode_pos;
+  int pin_count;
+  unsigned long long last_used;
+  int block_count;
+  int file_size;
+};
+
+// Free space of one slice of the inode or data region. A set bit in used means the position is taken.
+// Groups keep each thread's files together on disk; they are guarded by fs_lock like the rest of the file system.
+struct alloc_group {
+  int start;
+  int end;
+  int free_count;
+  vector<unsigned long long> used;
+};
+
+// On disk layouts chosen at create_disk
+enum disk_layout {
+  LAYOUT_BLOCK,
+  LAYOUT_LOG
+};
+
+/*
+ * Header of a log layout checkpoint, kept in last block of super region, one per checkpoint slot.
+ * head_segment and head_offset give where the log continues after the checkpoint.
+ * The valid header with the highest sequence is the last checkpoint.
+ */
+struct log_header {
+  int magic;
+  int layout;
+  int head_segment;
+  int head_offset;
+  long long sequence;
+};
+
+// Durability modes chosen at mount
+enum durability_mode {
+  DURABILITY_NONE,
+  DURABILITY_PERIODIC,
+  DURABILITY_ON_CLOSE,
+  DURABILITY_PER_OP
+};
+
+// Operations with latency histograms
+enum fs_op {
+  OP_CREATE,
+  OP_OPEN,
+  OP_READ,
+  OP_WRITE,
+  OP_APPEND,
+  OP_CLOSE,
+  OP_DELETE,
+  OP_SEARCH,
+  OP_EXPORT,
+  OP_IMPORT,
+  OP_COUNT
+};
+
+// I/O counters
+enum fs_counter {
+  IO_SEEK_CALLS,
+  IO_READ_CALLS,
+  IO_WRITE_CALLS,
+  IO_BYTES_READ,
+  IO_BYTES_WRITTEN,
+  IO_INODE_SCANS,
+  IO_INODE_SCAN_LENGTH,
+  IO_BLOCK_SCANS,
+  IO_BLOCK_SCAN_LENGTH,
+  IO_ZERO_BLOCKS_SKIPPED,
+  IO_SYNC_CALLS,
+  IO_CHECKPOINTS,
+  IO_SEGMENTS_CLEANED,
+  IO_KERNEL_COPY_BYTES,
+  IO_COUNT
+};
+
+/*
+ * Functions to check if a range of bytes is all zero.
+ * AVX2 is used when the CPU has it, then SSE2, with a scalar loop for other targets and tails.
+ */
+static int is_zero_scalar(const char* data, int size){
+  for(int i=0;i<size;++i){
+    if(data[i] != 0){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static int is_zero_avx2(const char* data, int size){
+  int i = 0;
+  for(;i+128<=size;i+=128){
+    __m256i acc = _mm256_or_si256(
+      _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(data+i)), _mm256_loadu_si256((const __m256i*)(data+i+32))),
+      _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(data+i+64)), _mm256_loadu_si256((const __m256i*)(data+i+96))));
+    if(!_mm256_testz_si256(acc, acc)){
+      return 0;
+    }
+  }
+  return is_zero_scalar(data+i, size-i);
+}
+
+static int is_zero_sse2(const char* data, int size){
+  int i = 0;
+  __m128i zero = _mm_setzero_si128();
+  for(;i+64<=size;i+=64){
+    __m128i acc = _mm_or_si128(
+      _mm_or_si128(_mm_loadu_si128((const __m128i*)(data+i)), _mm_loadu_si128((const __m128i*)(data+i+16))),
+      _mm_or_si128(_mm_loadu_si128((const __m128i*)(data+i+32)), _mm_loadu_si128((const __m128i*)(data+i+48))));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff){
+      return 0;
+    }
+  }
+  return is_zero_scalar(data+i, size-i);
+}
+#endif
+
+static int is_zero_range(const char* data, int size){
+#if defined(__x86_64__)
+  static const int has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2 ? is_zero_avx2(data, size) : is_zero_sse2(data, size);
+#else
+  return is_zero_scalar(data, size);
+#endif
+}
+
+/*
+ * Functions to find every offset where a pattern starts in a range of bytes, up to limit offsets.
+ * Vector versions compare first and last pattern bytes at 32 (AVX2) or 16 (SSE2) positions at once,
+ * and only check the rest of the pattern where both match.
+ */
+static void find_scalar(const char* data, int size, const char* pattern, int length, int base, vector<int>& offsets, int limit){
+  for(int i=0;i+length<=size&&offsets.size()<limit;++i){
+    const char* next = (const char*)memchr(data+i, pattern[0], size-length-i+1);
+    if(next == NULL){
+      return;
+    }
+    i = next-data;
+    if(memcmp(data+i+1, pattern+1, length-1) == 0){
+      offsets.push_back(base+i);
+    }
+  }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void find_avx2(const char* data, int size, const char* pattern, int length, int base, vector<int>& offsets, int limit){
+  int i = 0;
+  __m256i first = _mm256_set1_epi8(pattern[0]);
+  __m256i last = _mm256_set1_epi8(pattern[length-1]);
+  for(;i+length-1+32<=size;i+=32){
+    __m256i eq_first = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i*)(data+i)));
+    __m256i eq_last = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i*)(data+i+length-1)));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last));
+    for(;mask!=0;mask&=mask-1){
+      int pos = i+__builtin_ctz(mask);
+      if(memcmp(data+pos+1, pattern+1, length-1) == 0){
+        if(offsets.size() >= limit){
+          return;
+        }
+        offsets.push_back(base+pos);
+      }
+    }
+  }
+  find_scalar(data+i, size-i, pattern, length, base+i, offsets, limit);
+}
+
+static void find_sse2(const char* data, int size, const char* pattern, int length, int base, vector<int>& offsets, int limit){
+  int i = 0;
+  __m128i first = _mm_set1_epi8(pattern[0]);
+  __m128i last = _mm_set1_epi8(pattern[length-1]);
+  for(;i+length-1+16<=size;i+=16){
+    __m128i eq_first = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i*)(data+i)));
+    __m128i eq_last = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i*)(data+i+length-1)));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+    for(;mask!=0;mask&=mask-1){
+      int pos = i+__builtin_ctz(mask);
+      if(memcmp(data+pos+1, pattern+1, length-1) == 0){
+        if(offsets.size() >= limit){
+          return;
+        }
+        offsets.push_back(base+pos);
+      }
+    }
+  }
+  find_scalar(data+i, size-i, pattern, length, base+i, offsets, limit);
+}
+#endif
+
+static void find_all(const char* data, int size, const char* pattern, int length, int base, vector<int>& offsets, int limit){
+#if defined(__x86_64__)
+  static const int has_avx2 = __builtin_cpu_supports("avx2");
+  if(has_avx2){
+    find_avx2(data, size, pattern, length, base, offsets, limit);
+  }else{
+    find_sse2(data, size, pattern, length, base, offsets, limit);
+  }
+#else
+  find_scalar(data, size, pattern, length, base, offsets, limit);
+#endif
+}
+
+// Options for search
+struct search_options {
+  int max_matches; // Per file, 0 for all
+  int thread_count; // 0 for one per core
+};
+
+struct search_result {
+  char file_name[FILE_NAME_SIZE];
+  vector<int> offsets;
+};
+
+struct op_stats {
+  long long count;
+  long long p50_ns;
+  long long p99_ns;
+  long long p999_ns;
+};
+
+struct fs_stats {
+  struct op_stats ops[OP_COUNT];
+  long long io[IO_COUNT];
+};
+
+// Traced calls without a latency histogram, numbered after fs_op
+enum trace_op {
+  TRACE_FSYNC = OP_COUNT,
+  TRACE_SEEK_DATA,
+  TRACE_SEEK_HOLE,
+  TRACE_CREATE_BATCH,
+  TRACE_DELETE_BATCH
+};
+
+// Flags of a trace record
+enum trace_flag {
+  // Data written, appended or imported was all zeroes
+  TRACE_ZERO_DATA = 1
+};
+
+// Header at start of trace file, with layout and durability of disk the calls ran on
+struct __attribute__((packed)) trace_header {
+  int magic;
+  unsigned char layout;
+  unsigned char durability;
+};
+
+// Record written to trace file for each traced call, followed by name_len bytes of file name.
+// Batch records are followed instead by arg names, each a length byte and its characters.
+struct __attribute__((packed)) trace_record {
+  long long timestamp_ns;
+  int fd;
+  int arg;
+  unsigned char op;
+  unsigned char flags;
+  unsigned char name_len;
+};
+
+/*
+ * Class to hold operation counters and latency histograms.
+ * Counters are spread over shards so that each thread updates its own cache line,
+ * and all updates are relaxed atomics. Histogram bucket b holds latencies in [2^b, 2^(b+1)) ns.
+ */
+class StatsRecorder {
 private:
-  FILE *fp;
-  vector<struct file_info> file_list;
-  vector<struct open_file_info> open_file_list;
-  int file_descriptor_count;
-public:
-  FileSystem(){
-    file_descriptor_count = 0;
-    fp = NULL;
+  struct alignas(64) stats_shard {
+    atomic<long long> latency[OP_COUNT][STATS_BUCKETS];
+    atomic<long long> io[IO_COUNT];
+  };
+  stats_shard shards[STATS_SHARDS];
+
+  stats_shard& local_shard(){
+    static atomic<int> next_shard(0);
+    static thread_local int shard = next_shard.fetch_add(1, memory_order_relaxed) % STATS_SHARDS;
+    return shards[shard];
   }
 
   /*
-   * Function to create an empty file of size DISK_SIZE.
-   *
-   * Params:
-   * disk_name -- string
+   * Function to get the latency below which given fraction of operations completed.
    *
    * Retval:
-   * -1 -- Failed to create disk
-   * 0 -- Disk with given disk name exists
-   * 1 -- Disk created successfully
+   * Upper bound of the histogram bucket holding the percentile (0 if no operations)
+   */
+  static long long percentile(long long* buckets, long long count, double fraction){
+    if(count == 0){
+      return 0;
+    }
+    long long target = (long long)(fraction*count);
+    if(target >= count){
+      target = count-1;
+    }
+    long long seen = 0;
+    for(int b=0;b<STATS_BUCKETS;++b){
+      seen += buckets[b];
+      if(seen > target){
+        return (b >= 62) ? LLONG_MAX : (1LL<<(b+1));
+      }
+    }
+    return LLONG_MAX;
+  }
+public:
+  StatsRecorder(){
+    reset();
+  }
+
+  void reset(){
+    for(int s=0;s<STATS_SHARDS;++s){
+      for(int op=0;op<OP_COUNT;++op){
+        for(int b=0;b<STATS_BUCKETS;++b){
+          shards[s].latency[op][b].store(0, memory_order_relaxed);
+        }
+      }
+      for(int c=0;c<IO_COUNT;++c){
+        shards[s].io[c].store(0, memory_order_relaxed);
+      }
+    }
+  }
+
+  void add(int counter, long long value){
+    local_shard().io[counter].fetch_add(value, memory_order_relaxed);
+  }
+
+  void record_latency(int op, long long ns){
+    int bucket = (ns <= 1) ? 0 : 63-__builtin_clzll((unsigned long long)ns);
+    local_shard().latency[op][bucket].fetch_add(1, memory_order_relaxed);
+  }
+
+  /*
+   * Function to sum all shards into a snapshot.
    */
-  int create_disk(char* disk_name){
+  struct fs_stats snapshot(){
+    struct fs_stats res;
+    for(int op=0;op<OP_COUNT;++op){
+      long long buckets[STATS_BUCKETS];
+      long long count = 0;
+      for(int b=0;b<STATS_BUCKETS;++b){
+        buckets[b] = 0;
+        for(int s=0;s<STATS_SHARDS;++s){
+          buckets[b] += shards[s].latency[op][b].load(memory_order_relaxed);
+        }
+        count += buckets[b];
+      }
+      res.ops[op].count = count;
+      res.ops[op].p50_ns = percentile(buckets, count, 0.5);
+      res.ops[op].p99_ns = percentile(buckets, count, 0.99);
+      res.ops[op].p999_ns = percentile(buckets, count, 0.999);
+    }
+    for(int c=0;c<IO_COUNT;++c){
+      res.io[c] = 0;
+      for(int s=0;s<STATS_SHARDS;++s){
+        res.io[c] += shards[s].io[c].load(memory_order_relaxed);
+      }
+    }
+    return res;
+  }
+};
+
+/*
+ * Class to record latency of an operation when it goes out of scope.
+ */
+class OpTimer {
+private:
+  StatsRecorder& stats;
+  int op;
+  chrono::steady_clock::time_point start;
+public:
+  OpTimer(StatsRecorder& stats, int op) : stats(stats), op(op), start(chrono::steady_clock::now()) {}
+
+  ~OpTimer(){
+    long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-start).count();
+    stats.record_latency(op, ns);
+  }
+};
+
+/*
+ * Disk geometry policy. Positions are 1-based block numbers, and regions are
+ * super blocks [1, SuperEnd], inodes [SuperEnd+1, InodeEnd] and data blocks [InodeEnd+1, BlockEnd].
+ * Block size is 2^BlockShift, so offsets are computed with a shift.
+ */
+template <long DiskSize, int BlockShift, int SuperEnd, int InodeEnd, int BlockEnd>
+struct disk_geometry {
+  static constexpr long disk_size = DiskSize;
+  static constexpr int block_shift = BlockShift;
+  static constexpr int block_size = 1<<BlockShift;
+  static constexpr int super_start = 1;
+  static constexpr int super_end = SuperEnd;
+  static constexpr int inode_start = SuperEnd+1;
+  static constexpr int inode_end = InodeEnd;
+  static constexpr int block_start = InodeEnd+1;
+  static constexpr int block_end = BlockEnd;
+  static constexpr int max_inode_blocks = (block_size-sizeof(int))/sizeof(struct inode_data);
+
+  static_assert(SuperEnd < InodeEnd && InodeEnd < BlockEnd, "Regions must be in order");
+  static_assert((long)BlockEnd<<BlockShift <= DiskSize, "Data region must fit on disk");
+
+  static constexpr long offset(int pos){
+    return (long)(pos-1)<<BlockShift;
+  }
+};
+
+typedef disk_geometry<DISK_SIZE, 12, SUPER_END, INODE_END, BLOCK_END> default_geometry;
+
+/*
+ * Storage policies. Each one keeps a current position, like a FILE*, and provides:
+ * create -- make a zeroed disk of given size (-1 failed, 0 exists, 1 created)
+ * open, close, is_open, seek, read, write
+ * sync -- make written data durable (-1 failed, 0 done); must be safe to call from another thread
+ * mapped -- pointer to bytes at offset if disk is in memory, else NULL
+ * read_at -- read at offset without moving position; must be safe to call from several threads
+ * native_fd -- file descriptor of disk for kernel side copies, with buffered writes flushed, or -1 if disk is in memory
+ */
+
+// Disk file accessed through stdio
+class stdio_storage {
+private:
+  FILE *fp;
+public:
+  stdio_storage(){
+    fp = NULL;
+  }
+
+  static int create(const char* disk_name, long size){
     if(access(disk_name, F_OK) == 0){
       return 0;
     }
-    int fd = open(disk_name, O_CREAT, 0666);
+    int fd = open(disk_name, O_CREAT|O_RDWR, 0666);
+    if(fd < 0){
+      return -1;
+    }
+    int res = ftruncate(fd, size);
     close(fd);
+    return res == 0 ? 1 : -1;
+  }
+
+  int open_disk(const char* disk_name){
     fp = fopen(disk_name, "r+b");
+    return fp == NULL ? -1 : 0;
+  }
+
+  int close_disk(){
     if(fp == NULL){
       return -1;
     }
-    fseek(fp, DISK_SIZE-1, 0);
-    fputc('\0', fp);
     fclose(fp);
+    fp = NULL;
+    return 0;
+  }
 
-    return 1;
+  int is_open(){
+    return fp != NULL;
   }
 
-  /*
-   * Function to open disk file.
-   *
-   * Params:
-   * disk_name -- string
-   *
-   * Retval:
-   * -1 -- Failed to mount disk
-   * 0 -- Successfully mounted disk
-   */
-  int mount_disk(char* disk_name){
-    // Open corresponding file
-    fp = fopen(disk_name, "r+b");
-    // Check if file was opened successfully
-    if(fp == NULL){
+  int seek(long offset){
+    return fseek(fp, offset, 0);
+  }
+
+  size_t read(void* ptr, size_t size){
+    return fread(ptr, 1, size, fp);
+  }
+
+  size_t write(const void* ptr, size_t size){
+    return fwrite(ptr, 1, size, fp);
+  }
+
+  int sync(){
+    if(fflush(fp) != 0){
       return -1;
     }
-    get_files_in_disk();
+    return fdatasync(fileno(fp));
+  }
+
+  const char* mapped(long offset){
+    return NULL;
+  }
+
+  size_t read_at(void* ptr, size_t size, long offset){
+    // Writes still in stdio buffer must reach file first
+    fflush(fp);
+    ssize_t res = pread(fileno(fp), ptr, size, offset);
+    return res < 0 ? 0 : res;
+  }
+
+  int native_fd(){
+    fflush(fp);
+    return fileno(fp);
+  }
+};
+
+// Disk file accessed with pread and pwrite, so no user space buffering
+class pread_storage {
+private:
+  int fd;
+  long pos;
+public:
+  pread_storage(){
+    fd = -1;
+    pos = 0;
+  }
+
+  static int create(const char* disk_name, long size){
+    return stdio_storage::create(disk_name, size);
+  }
+
+  int open_disk(const char* disk_name){
+    fd = open(disk_name, O_RDWR);
+    pos = 0;
+    return fd < 0 ? -1 : 0;
+  }
+
+  int close_disk(){
+    if(fd < 0){
+      return -1;
+    }
+    close(fd);
+    fd = -1;
+    return 0;
+  }
+
+  int is_open(){
+    return fd >= 0;
+  }
+
+  int seek(long offset){
+    pos = offset;
+    return 0;
+  }
+
+  size_t read(void* ptr, size_t size){
+    ssize_t res = pread(fd, ptr, size, pos);
+    if(res < 0){
+      return 0;
+    }
+    pos += res;
+    return res;
+  }
+
+  size_t write(const void* ptr, size_t size){
+    ssize_t res = pwrite(fd, ptr, size, pos);
+    if(res < 0){
+      return 0;
+    }
+    pos += res;
+    return res;
+  }
+
+  int sync(){
+    return fdatasync(fd);
+  }
+
+  const char* mapped(long offset){
+    return NULL;
+  }
+
+  size_t read_at(void* ptr, size_t size, long offset){
+    ssize_t res = pread(fd, ptr, size, offset);
+    return res < 0 ? 0 : res;
+  }
+
+  int native_fd(){
+    return fd;
+  }
+};
+
+// Base for storage held in memory, which reads and writes are copies into
+class memory_storage {
+protected:
+  char* base;
+  long size;
+  long pos;
+public:
+  memory_storage(){
+    base = NULL;
+    size = 0;
+    pos = 0;
+  }
+
+  int is_open(){
+    return base != NULL;
+  }
+
+  int seek(long offset){
+    if(offset < 0 || offset > size){
+      return -1;
+    }
+    pos = offset;
+    return 0;
+  }
+
+  size_t read(void* ptr, size_t count){
+    count = min((long)count, size-pos);
+    memcpy(ptr, base+pos, count);
+    pos += count;
+    return count;
+  }
+
+  size_t write(const void* ptr, size_t count){
+    count = min((long)count, size-pos);
+    memcpy(base+pos, ptr, count);
+    pos += count;
+    return count;
+  }
+
+  const char* mapped(long offset){
+    return (offset < size) ? base+offset : NULL;
+  }
+
+  size_t read_at(void* ptr, size_t count, long offset){
+    count = max(0L, min((long)count, size-offset));
+    memcpy(ptr, base+offset, count);
+    return count;
+  }
+
+  int native_fd(){
+    return -1;
+  }
+};
+
+// Disk file mapped into memory
+class mmap_storage : public memory_storage {
+public:
+  static int create(const char* disk_name, long size){
+    return stdio_storage::create(disk_name, size);
+  }
+
+  int open_disk(const char* disk_name){
+    int fd = open(disk_name, O_RDWR);
+    if(fd < 0){
+      return -1;
+    }
+    struct stat info;
+    fstat(fd, &info);
+    void* res = mmap(NULL, info.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(res == MAP_FAILED){
+      return -1;
+    }
+    base = (char*)res;
+    size = info.st_size;
+    pos = 0;
+    return 0;
+  }
+
+  int close_disk(){
+    if(base == NULL){
+      return -1;
+    }
+    munmap(base, size);
+    base = NULL;
     return 0;
   }
 
+  int sync(){
+    return msync(base, size, MS_SYNC);
+  }
+};
+
+// Disk held only in memory, named in a process wide list. Contents last until remove_disk.
+class ram_storage : public memory_storage {
+private:
+  static map<string, pair<char*, long> >& disks(){
+    static map<string, pair<char*, long> > disk_list;
+    return disk_list;
+  }
+public:
+  static int create(const char* disk_name, long size){
+    if(disks().count(disk_name)){
+      return 0;
+    }
+    // Anonymous mapping, so untouched pages cost no memory
+    void* res = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(res == MAP_FAILED){
+      return -1;
+    }
+    disks()[disk_name] = make_pair((char*)res, size);
+    return 1;
+  }
+
   /*
-   * Function to close disk file.
-   *
-   * Params:
-   * disk_name -- string
+   * Function to free memory of a RAM disk.
    *
    * Retval:
-   * -1 -- Failed to unmount disk (most likely, disk wasn't mounted)
-   * 0 -- Successfully unmounted disk
+   * -1 -- No such disk
+   * 0 -- Disk removed
    */
-  int unmount_disk(){
-    if(fp == NULL){
+  static int remove_disk(const char* disk_name){
+    map<string, pair<char*, long> >::iterator it = disks().find(disk_name);
+    if(it == disks().end()){
       return -1;
     }
-    open_file_list.clear();
+    munmap(it->second.first, it->second.second);
+    disks().erase(it);
+    return 0;
+  }
+
+  int open_disk(const char* disk_name){
+    map<string, pair<char*, long> >::iterator it = disks().find(disk_name);
+    if(it == disks().end()){
+      return -1;
+    }
+    base = it->second.first;
+    size = it->second.second;
+    pos = 0;
+    return 0;
+  }
+
+  int close_disk(){
+    if(base == NULL){
+      return -1;
+    }
+    base = NULL;
+    return 0;
+  }
+
+  int sync(){
+    return 0;
+  }
+};
+
+/*
+ * File system on a disk with given geometry, accessed through given storage policy.
+ */
+template <class Geometry, class Storage>
+class BasicFileSystem {
+private:
+  Storage storage;
+  vector<struct file_info> file_list;
+  vector<struct open_file_info> open_file_list;
+  int file_descriptor_count;
+  StatsRecorder stats;
+  FILE *trace_fp;
+  chrono::steady_clock::time_point trace_start;
+  // Inode cache: slots are pinned while a descriptor is open on the inode
+  vector<struct inode_cache_entry> inode_cache;
+  vector<struct inode_data> inode_arena;
+  vector<int> inode_slot;
+  unsigned long long cache_clock;
+  recursive_mutex fs_lock;
+  // Allocation groups, built from inodes at mount. Inode group i holds files whose blocks start in data group i.
+  struct alloc_group inode_groups[ALLOC_GROUPS];
+  struct alloc_group block_groups[ALLOC_GROUPS];
+  // Durability
+  int durability;
+  int flush_interval_ms;
+  atomic<int> dirty;
+  thread flusher;
+  mutex flusher_lock;
+  condition_variable flusher_wake;
+  int flusher_stop;
+  // Log layout: inode map and live blocks of each segment. Owner of a data block is its inode, or minus the
+  // inode for a block holding an inode. All but the inode map are rebuilt at mount.
+  int layout;
+  // Checkpoints alternate between slots. imap_dirty and list_stale hold a bit for each slot which is behind memory.
+  vector<int> imap;
+  vector<char> imap_dirty;
+  int file_list_dirty;
+  int list_stale;
+  int checkpoint_slot;
+  vector<int> block_owner;
+  vector<int> segment_live;
+  vector<char> segment_clean;
+  int head_segment;
+  int head_offset;
+  // Head segment was taken from the reserve, so only inodes and the cleaner write to it
+  int head_reserved;
+  long long checkpoint_sequence;
+  int log_blocks_since_checkpoint;
+  int cleaning;
+  // Set while a call changes a cached inode, so allocations neither checkpoint nor clean until it is written
+  int update_open;
+  vector<int> deferred_frees;
+  vector<char> block_buffer;
+  vector<struct inode_data> clean_map;
+  thread cleaner;
+  mutex cleaner_lock;
+  condition_variable cleaner_wake;
+  int cleaner_stop;
+
+  /*
+   * Function to sync disk if anything was written since last sync.
+   *
+   * Retval:
+   * -1 -- Sync failed
+   * 0 -- Synced, or nothing to sync
+   */
+  int sync_dirty(){
+    if(layout == LAYOUT_LOG){
+      lock_guard<recursive_mutex> guard(fs_lock);
+      if(file_list_dirty || log_blocks_since_checkpoint > 0){
+        write_checkpoint();
+      }
+    }
+    if(dirty.exchange(0) == 0){
+      return 0;
+    }
+    if(storage.sync() < 0){
+      dirty = 1;
+      return -1;
+    }
+    stats.add(IO_SYNC_CALLS, 1);
+    return 0;
+  }
+
+  /*
+   * Function to sync after a completed operation when mounted in given mode.
+   */
+  void sync_for_mode(int mode){
+    if(durability == mode){
+      sync_dirty();
+    }
+  }
+
+  /*
+   * Function run by background thread in periodic mode.
+   * Storage sync is thread safe, so the flusher only takes io_lock() to write a checkpoint in log layout.
+   */
+  void run_flusher(){
+    unique_lock<mutex> guard(flusher_lock);
+    while(!flusher_stop){
+      flusher_wake.wait_for(guard, chrono::milliseconds(flush_interval_ms));
+      sync_dirty();
+    }
+  }
+
+  void stop_flusher(){
+    if(flusher.joinable()){
+      {
+        lock_guard<mutex> guard(flusher_lock);
+        flusher_stop = 1;
+      }
+      flusher_wake.notify_one();
+      flusher.join();
+    }
+  }
+
+  /*
+   * Function run by background thread in log layout, cleaning segments once few are clean.
+   */
+  void run_cleaner(){
+    while(1){
+      {
+        unique_lock<mutex> guard(cleaner_lock);
+        cleaner_wake.wait_for(guard, chrono::milliseconds(CLEANER_INTERVAL_MS));
+        if(cleaner_stop){
+          return;
+        }
+      }
+      lock_guard<recursive_mutex> guard(fs_lock);
+      if(count_clean_segments() < CLEAN_LOW_SEGMENTS){
+        clean_segments(CLEAN_LOW_SEGMENTS);
+      }
+    }
+  }
+
+  void stop_cleaner(){
+    if(cleaner.joinable()){
+      {
+        lock_guard<mutex> guard(cleaner_lock);
+        cleaner_stop = 1;
+      }
+      cleaner_wake.notify_one();
+      cleaner.join();
+    }
+  }
+
+  /*
+   * Function to append a record for a public call to trace file, if tracing is on.
+   * For open, fd is the descriptor returned. For read, write and append, arg is the buffer size
+   * (-1 when whole file is displayed). For open, arg is the mode. For seek_data and seek_hole, arg is the offset.
+   * For search, name is the pattern (cut to 255 bytes), fd the thread count and arg the match limit.
+   * For import, arg is the number of bytes imported.
+   * flags holds trace_flag bits, so replay can write zeroes where the traced call did.
+   */
+  void trace_call(int op, int fd, int arg, const char* file_name, int flags = 0){
+    if(trace_fp == NULL){
+      return;
+    }
+    struct trace_record rec;
+    rec.timestamp_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-trace_start).count();
+    rec.fd = fd;
+    rec.arg = arg;
+    rec.op = op;
+    rec.flags = flags;
+    if(file_name == NULL){
+      file_name = "";
+    }
+    rec.name_len = min(strlen(file_name), (size_t)UCHAR_MAX);
+    fwrite(&rec, sizeof(rec), 1, trace_fp);
+    fwrite(file_name, 1, rec.name_len, trace_fp);
+  }
+
+  /*
+   * Function to write trace header with layout and durability of disk, if tracing is on.
+   */
+  void write_trace_header(){
+    if(trace_fp == NULL){
+      return;
+    }
+    struct trace_header header;
+    header.magic = TRACE_MAGIC;
+    header.layout = layout;
+    header.durability = durability;
+    long pos = ftell(trace_fp);
+    fseek(trace_fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, trace_fp);
+    fseek(trace_fp, max(pos, (long)sizeof(header)), SEEK_SET);
+  }
+
+  /*
+   * Function to append one record for a batch create or delete to trace file, if tracing is on,
+   * so replay runs it as one batch call.
+   */
+  void trace_batch(int op, char** file_names, int count){
+    if(trace_fp == NULL){
+      return;
+    }
+    trace_call(op, -1, count, NULL);
+    for(int i=0;i<count;++i){
+      unsigned char name_len = min(strlen(file_names[i]), (size_t)UCHAR_MAX);
+      fwrite(&name_len, 1, 1, trace_fp);
+      fwrite(file_names[i], 1, name_len, trace_fp);
+    }
+  }
+
+  /*
+   * Wrappers around stdio calls on disk file which update I/O counters.
+   */
+  int disk_seek(long offset){
+    stats.add(IO_SEEK_CALLS, 1);
+    return storage.seek(offset);
+  }
+
+  size_t disk_read(void* ptr, size_t size, size_t count){
+    stats.add(IO_READ_CALLS, 1);
+    size_t res = storage.read(ptr, size*count);
+    stats.add(IO_BYTES_READ, res);
+    return size == 0 ? 0 : res/size;
+  }
+
+  size_t disk_write(const void* ptr, size_t size, size_t count){
+    stats.add(IO_WRITE_CALLS, 1);
+    dirty.store(1, memory_order_relaxed);
+    size_t res = storage.write(ptr, size*count);
+    stats.add(IO_BYTES_WRITTEN, res);
+    return size == 0 ? 0 : res/size;
+  }
+
+  struct inode_data* cache_map(int slot){
+    return &inode_arena[slot*Geometry::max_inode_blocks];
+  }
+
+  /*
+   * Function to empty inode cache.
+   */
+  void reset_inode_cache(){
+    inode_cache.assign(INODE_CACHE_SIZE, inode_cache_entry());
+    inode_arena.assign(INODE_CACHE_SIZE*Geometry::max_inode_blocks, inode_data());
+    inode_slot.assign(Geometry::inode_end-Geometry::inode_start+1, -1);
+    cache_clock = 0;
+  }
+
+  /*
+   * Function to get cache slot holding given inode, reading inode from disk if not cached.
+   * The least recently used unpinned slot is reused. The cache only grows when every slot is pinned.
+   *
+   * Retval:
+   * Cache slot of inode
+   */
+  int cache_inode(int inode_pos){
+    int slot = inode_slot[inode_pos-Geometry::inode_start];
+    if(slot >= 0){
+      inode_cache[slot].last_used = ++cache_clock;
+      return slot;
+    }
+    for(int i=0;i<inode_cache.size();++i){
+      if(inode_cache[i].pin_count == 0 && (slot < 0 || inode_cache[i].last_used < inode_cache[slot].last_used)){
+        slot = i;
+        if(inode_cache[i].inode_pos == 0){
+          break;
+        }
+      }
+    }
+    if(slot < 0){
+      slot = inode_cache.size();
+      inode_cache.push_back(inode_cache_entry());
+      inode_arena.resize(inode_arena.size()+Geometry::max_inode_blocks);
+    }
+    struct inode_cache_entry& entry = inode_cache[slot];
+    if(entry.inode_pos != 0){
+      inode_slot[entry.inode_pos-Geometry::inode_start] = -1;
+    }
+    // Read whole inode in two reads
+    struct inode_data* map = cache_map(slot);
+    disk_seek(inode_offset(inode_pos));
+    int block_count = 0;
+    disk_read(&block_count, sizeof(block_count), 1);
+    block_count = max(0, min(block_count, Geometry::max_inode_blocks));
+    disk_read(map, sizeof(struct inode_data), block_count);
+    entry.inode_pos = inode_pos;
+    entry.pin_count = 0;
+    entry.last_used = ++cache_clock;
+    entry.block_count = block_count;
+    entry.file_size = 0;
+    for(int j=0;j<block_count;++j){
+      entry.file_size += map[j].block_filled;
+    }
+    inode_slot[inode_pos-Geometry::inode_start] = slot;
+    return slot;
+  }
+
+  /*
+   * Function to drop given inode from cache.
+   */
+  void uncache_inode(int inode_pos){
+    int slot = inode_slot[inode_pos-Geometry::inode_start];
+    if(slot >= 0){
+      inode_cache[slot] = inode_cache_entry();
+      inode_slot[inode_pos-Geometry::inode_start] = -1;
+    }
+  }
+
+  /*
+   * Function to write block count and inode entries from given index onwards back to disk.
+   */
+  void write_inode(int slot, int from){
+    struct inode_cache_entry& entry = inode_cache[slot];
+    if(layout == LAYOUT_LOG){
+      // Inode is whole again, so storing it may checkpoint and clean
+      update_open = 0;
+      store_inode(entry.inode_pos, entry.block_count, cache_map(slot));
+      return;
+    }
+    disk_seek(Geometry::offset(entry.inode_pos));
+    disk_write(&entry.block_count, sizeof(entry.block_count), 1);
+    if(from > 0){
+      disk_seek(Geometry::offset(entry.inode_pos)+sizeof(int)+from*sizeof(struct inode_data));
+    }
+    disk_write(cache_map(slot)+from, sizeof(struct inode_data), entry.block_count-from);
+  }
+
+  /*
+   * Function to get cache slot of file open with given file descriptor.
+   *
+   * Retval:
+   * -1 -- No file open with given file descriptor
+   * Cache slot of file's inode
+   */
+  int get_open_slot(int fd){
+    for(int i=0;i<open_file_list.size();++i){
+      if(open_file_list[i].fd == fd){
+        return open_file_list[i].cache_slot;
+      }
+    }
+    return -1;
+  }
+
+  /*
+   * Function to split a region into allocation groups with every position free.
+   */
+  void init_alloc_groups(struct alloc_group* groups, int start, int end){
+    int group_size = (end-start+ALLOC_GROUPS)/ALLOC_GROUPS;
+    for(int g=0;g<ALLOC_GROUPS;++g){
+      groups[g].start = start+g*group_size;
+      groups[g].end = min(end, groups[g].start+group_size-1);
+      int count = max(0, groups[g].end-groups[g].start+1);
+      groups[g].free_count = count;
+      groups[g].used.assign((count+63)/64, 0);
+    }
+  }
+
+  /*
+   * Function to get allocation group holding given position.
+   */
+  int group_of(struct alloc_group* groups, int pos){
+    int group_size = groups[0].end-groups[0].start+1;
+    return min(ALLOC_GROUPS-1, (pos-groups[0].start)/group_size);
+  }
+
+  /*
+   * Function to mark a position as taken or free in its allocation group.
+   */
+  void mark_position(struct alloc_group* groups, int pos, int taken){
+    struct alloc_group& group = groups[group_of(groups, pos)];
+    int bit = pos-group.start;
+    unsigned long long mask = 1ULL<<(bit%64);
+    if(((group.used[bit/64]&mask) != 0) == (taken != 0)){
+      return;
+    }
+    group.used[bit/64] ^= mask;
+    group.free_count += taken ? -1 : 1;
+  }
+
+  /*
+   * Function to take the first free position at or after from in one group, wrapping to group start.
+   *
+   * Retval:
+   * -1 -- Group is full
+   * Non negative integer -- Position
+   */
+  int take_in_group(struct alloc_group& group, int from, int scan_counter){
+    if(group.free_count == 0){
+      return -1;
+    }
+    int words = group.used.size();
+    int first = (max(from, group.start)-group.start)/64;
+    for(int n=0;n<=words;++n){
+      int w = (first+n)%words;
+      stats.add(scan_counter, 1);
+      unsigned long long free_bits = ~group.used[w];
+      // Skip bits before from in first word, and bits past end of group in last word
+      if(n == 0 && from > group.start){
+        free_bits &= ~0ULL<<((from-group.start)%64);
+      }
+      if(w == words-1 && (group.end-group.start+1)%64 != 0){
+        free_bits &= (1ULL<<((group.end-group.start+1)%64))-1;
+      }
+      if(free_bits != 0){
+        int bit = w*64+__builtin_ctzll(free_bits);
+        group.used[w] |= 1ULL<<(bit%64);
+        --group.free_count;
+        return group.start+bit;
+      }
+    }
+    return -1;
+  }
+
+  /*
+   * Function to take a free position, preferring given group and falling back to the others in order.
+   *
+   * Retval:
+   * -1 -- Region is full
+   * Non negative integer -- Position
+   */
+  int take_position(struct alloc_group* groups, int group, int from, int scan_counter){
+    for(int n=0;n<ALLOC_GROUPS;++n){
+      int g = (group+n)%ALLOC_GROUPS;
+      int pos = take_in_group(groups[g], (n == 0) ? from : groups[g].start, scan_counter);
+      if(pos >= 0){
+        return pos;
+      }
+    }
+    return -1;
+  }
+
+  /*
+   * Function to get group new files of calling thread go to.
+   * Threads are handed groups in turn so files written by different threads are placed in different parts of the disk
+   * instead of interleaving their blocks.
+   * Once its group has less free space than average, a thread moves to the emptiest group.
+   */
+  int file_group(){
+    static atomic<int> next_group(0);
+    thread_local int preferred = next_group++%ALLOC_GROUPS;
+    long long total_free = 0;
+    int emptiest = preferred;
+    for(int g=0;g<ALLOC_GROUPS;++g){
+      total_free += block_groups[g].free_count;
+      if(block_groups[g].free_count > block_groups[emptiest].free_count){
+        emptiest = g;
+      }
+    }
+    if((long long)block_groups[preferred].free_count*ALLOC_GROUPS < total_free){
+      preferred = emptiest;
+    }
+    return preferred;
+  }
+
+  /*
+   * Function to rebuild allocation groups, and segment usage in log layout, from inodes of files on disk.
+   * Only positions owned by a file are taken, so space leaked by an interrupted update is reclaimed.
+   */
+  void build_alloc_groups(){
+    init_alloc_groups(inode_groups, Geometry::inode_start, Geometry::inode_end);
+    init_alloc_groups(block_groups, Geometry::block_start, Geometry::block_end);
+    block_owner.assign(Geometry::block_end-Geometry::block_start+1, 0);
+    segment_live.assign(segment_count, 0);
+    vector<struct inode_data> map(Geometry::max_inode_blocks);
+    for(int i=0;i<file_list.size();++i){
+      int inode_pos = file_list[i].inode_pos;
+      mark_position(inode_groups, inode_pos, 1);
+      if(layout == LAYOUT_LOG){
+        mark_live(imap[inode_pos-Geometry::inode_start], -inode_pos);
+      }
+      int block_count;
+      disk_seek(inode_offset(inode_pos));
+      disk_read(&block_count, sizeof(block_count), 1);
+      block_count = max(0, min(block_count, Geometry::max_inode_blocks));
+      disk_read(map.data(), sizeof(struct inode_data), block_count);
+      for(int j=0;j<block_count;++j){
+        if(layout == LAYOUT_LOG){
+          mark_live(map[j].block_pos, inode_pos);
+        }else if(map[j].block_pos >= Geometry::block_start && map[j].block_pos <= Geometry::block_end){
+          mark_position(block_groups, map[j].block_pos, 1);
+        }
+      }
+    }
+    // Segments with nothing live in the last checkpoint can be reused straight away
+    segment_clean.assign(segment_count, 0);
+    for(int seg=0;seg<segment_count;++seg){
+      segment_clean[seg] = (segment_live[seg] == 0 && seg != head_segment);
+    }
+  }
+
+  /*
+   * Function to allocate an inode in calling thread's group.
+   *
+   * Retval:
+   * -1 -- Empty inode not available
+   * Non negative integer -- Inode position
+   */
+  int alloc_inode(){
+    stats.add(IO_INODE_SCANS, 1);
+    int group = file_group();
+    return take_position(inode_groups, group, inode_groups[group].start, IO_INODE_SCAN_LENGTH);
+  }
+
+  /*
+   * Function to allocate a data block close to the rest of a file.
+   * Params:
+   * inode_pos -- int, inode of file
+   * near -- int, block the new one should follow, or 0 to start a file
+   *   A file starts at the point of the matching data group proportional to the inode's place in its group,
+   *   so files created together get room to grow without interleaving.
+   *
+   * Retval:
+   * -1 -- Empty block not available
+   * Non negative integer -- Block position
+   */
+  int alloc_block(int inode_pos, int near){
+    stats.add(IO_BLOCK_SCANS, 1);
+    if(layout == LAYOUT_LOG){
+      return take_log_block(inode_pos, 0);
+    }
+    if(near != 0){
+      return take_position(block_groups, group_of(block_groups, near), near+1, IO_BLOCK_SCAN_LENGTH);
+    }
+    int group = group_of(inode_groups, inode_pos);
+    long inode_span = inode_groups[group].end-inode_groups[group].start+1;
+    long block_span = max(0, block_groups[group].end-block_groups[group].start+1);
+    int goal = block_groups[group].start+(inode_pos-inode_groups[group].start)*block_span/inode_span;
+    return take_position(block_groups, group, goal, IO_BLOCK_SCAN_LENGTH);
+  }
+
+  /*
+   * Function to get last block before entry j of a block map, for allocating next to it.
+   *
+   * Retval:
+   * 0 -- No block before entry j
+   * Non negative integer -- Block position
+   */
+  int last_block(struct inode_data* map, int j){
+    for(int k=j-1;k>=0;--k){
+      if(map[k].block_pos != 0){
+        return map[k].block_pos;
+      }
+    }
+    return 0;
+  }
+
+  /*
+   * Function to mark a data block as free.
+   * The block's first int is cleared too, so images stay readable by scanning allocators.
+   * In log layout the block is only released once the inode no longer referring to it is stored.
+   */
+  void free_block(int block_pos){
+    if(layout == LAYOUT_LOG){
+      deferred_frees.push_back(block_pos);
+      return;
+    }
+    int empty = 0;
+    disk_seek(Geometry::offset(block_pos));
+    disk_write(&empty, sizeof(empty), 1);
+    mark_position(block_groups, block_pos, 0);
+  }
+
+  /*
+   * Function to mark an inode as free.
+   */
+  void free_inode(int inode_pos){
+    if(layout == LAYOUT_LOG){
+      int& pos = imap[inode_pos-Geometry::inode_start];
+      release_log_block(pos);
+      pos = 0;
+      imap_dirty[(inode_pos-Geometry::inode_start)*sizeof(int)/Geometry::block_size] = (1<<CHECKPOINT_SLOTS)-1;
+      release_deferred();
+      mark_position(inode_groups, inode_pos, 0);
+      return;
+    }
+    int empty = 0;
+    disk_seek(Geometry::offset(inode_pos));
+    disk_write(&empty, sizeof(empty), 1);
+    mark_position(inode_groups, inode_pos, 0);
+  }
+
+  /*
+   * Function to get where an inode is stored on disk.
+   */
+  long inode_offset(int inode_pos){
+    if(layout == LAYOUT_LOG){
+      return Geometry::offset(imap[inode_pos-Geometry::inode_start]);
+    }
+    return Geometry::offset(inode_pos);
+  }
+
+  /*
+   * Function to write a whole inode. In log layout it is appended to the log and the inode map updated.
+   */
+  void store_inode(int inode_pos, int block_count, struct inode_data* map){
+    if(layout != LAYOUT_LOG){
+      disk_seek(Geometry::offset(inode_pos));
+      disk_write(&block_count, sizeof(block_count), 1);
+      disk_write(map, sizeof(struct inode_data), block_count);
+      return;
+    }
+    int pos = take_log_block(-inode_pos, 1);
+    if(pos < 0){
+      return;
+    }
+    disk_seek(Geometry::offset(pos));
+    disk_write(&block_count, sizeof(block_count), 1);
+    disk_write(map, sizeof(struct inode_data), block_count);
+    int& old = imap[inode_pos-Geometry::inode_start];
+    release_log_block(old);
+    old = pos;
+    imap_dirty[(inode_pos-Geometry::inode_start)*sizeof(int)/Geometry::block_size] = (1<<CHECKPOINT_SLOTS)-1;
+    release_deferred();
+  }
+
+  int segment_of(int block_pos){
+    return (block_pos-Geometry::block_start)/SEGMENT_BLOCKS;
+  }
+
+  /*
+   * Function to record a log block as live and owned by given inode (negative for the inode's own block).
+   */
+  void mark_live(int block_pos, int owner){
+    if(block_pos < Geometry::block_start || segment_of(block_pos) >= segment_count){
+      return;
+    }
+    mark_position(block_groups, block_pos, 1);
+    block_owner[block_pos-Geometry::block_start] = owner;
+    ++segment_live[segment_of(block_pos)];
+  }
+
+  /*
+   * Function to record a log block as dead. Its segment is reused only after a checkpoint no longer needs it.
+   */
+  void release_log_block(int block_pos){
+    if(block_pos < Geometry::block_start || block_owner[block_pos-Geometry::block_start] == 0){
+      return;
+    }
+    mark_position(block_groups, block_pos, 0);
+    block_owner[block_pos-Geometry::block_start] = 0;
+    --segment_live[segment_of(block_pos)];
+  }
+
+  void release_deferred(){
+    for(int i=0;i<deferred_frees.size();++i){
+      release_log_block(deferred_frees[i]);
+    }
+    deferred_frees.clear();
+  }
+
+  int count_clean_segments(){
+    int count = 0;
+    for(int seg=0;seg<segment_count;++seg){
+      count += segment_clean[seg];
+    }
+    return count;
+  }
+
+  /*
+   * Function to count blocks that can be taken at log head, with or without using the reserve.
+   */
+  int log_room(int use_reserve){
+    int room = (head_segment < 0 || (head_reserved && !use_reserve)) ? 0 : SEGMENT_BLOCKS-head_offset;
+    return room+max(0, count_clean_segments()-(use_reserve ? 0 : LOG_RESERVE_SEGMENTS))*SEGMENT_BLOCKS;
+  }
+
+  /*
+   * Function to start a call that changes a cached inode and may allocate up to count blocks.
+   * In log layout, any checkpoint and cleaning needed to make room is done now, before the inode is touched.
+   * Until it is written, allocations do neither: a checkpoint would save a half changed inode map, and
+   * cleaning would move blocks whose positions the caller holds.
+   */
+  void begin_update(int count){
+    if(layout != LAYOUT_LOG){
+      return;
+    }
+    if(log_room(0) < count){
+      write_checkpoint();
+    }
+    if(log_room(0) < count){
+      clean_segments(LOG_RESERVE_SEGMENTS+max(1, (count+SEGMENT_BLOCKS-1)/SEGMENT_BLOCKS));
+    }
+    update_open = 1;
+  }
+
+  /*
+   * Function to move log head to a clean segment, checkpointing and cleaning to free one up if needed,
+   * unless an inode update is open. The last LOG_RESERVE_SEGMENTS clean segments are kept for inodes and the cleaner.
+   *
+   * Retval:
+   * -1 -- No clean segment available
+   * 0 -- Log head moved
+   */
+  int next_log_segment(int use_reserve){
+    for(int attempt=0;attempt<3;++attempt){
+      if(attempt == 1 && !cleaning && !update_open){
+        write_checkpoint();
+      }else if(attempt == 2 && !cleaning && !update_open){
+        clean_segments(LOG_RESERVE_SEGMENTS+1);
+      }
+      int clean_count = count_clean_segments();
+      if(clean_count == 0 || (!use_reserve && clean_count <= LOG_RESERVE_SEGMENTS)){
+        continue;
+      }
+      // Take the next clean segment after the head, so the log moves forward through the disk
+      for(int n=1;n<=segment_count;++n){
+        int seg = (head_segment+n+segment_count)%segment_count;
+        if(segment_clean[seg]){
+          segment_clean[seg] = 0;
+          head_segment = seg;
+          head_offset = 0;
+          head_reserved = clean_count <= LOG_RESERVE_SEGMENTS;
+          if(clean_count-1 < CLEAN_LOW_SEGMENTS){
+            cleaner_wake.notify_one();
+          }
+          return 0;
+        }
+      }
+    }
+    return -1;
+  }
+
+  /*
+   * Function to take next block at log head.
+   *
+   * Retval:
+   * -1 -- Log is full
+   * Non negative integer -- Block position
+   */
+  int take_log_block(int owner, int use_reserve){
+    if(head_segment < 0 || head_offset == SEGMENT_BLOCKS || (head_reserved && !use_reserve)){
+      if(next_log_segment(use_reserve) < 0){
+        return -1;
+      }
+    }
+    int pos = Geometry::block_start+head_segment*SEGMENT_BLOCKS+head_offset;
+    ++head_offset;
+    ++log_blocks_since_checkpoint;
+    mark_live(pos, owner);
+    return pos;
+  }
+
+  /*
+   * Function to copy first length bytes of a block to log head, freeing old block.
+   *
+   * Retval:
+   * -1 -- Log is full
+   * Non negative integer -- New block position
+   */
+  int copy_block(int block_pos, int length, int inode_pos, int use_reserve){
+    int pos = take_log_block(inode_pos, use_reserve);
+    if(pos < 0){
+      return -1;
+    }
+    if(length > 0){
+      disk_seek(Geometry::offset(block_pos));
+      disk_read(block_buffer.data(), 1, length);
+      disk_seek(Geometry::offset(pos));
+      disk_write(block_buffer.data(), 1, length);
+    }
+    free_block(block_pos);
+    return pos;
+  }
+
+  /*
+   * Function to clean segments with fewest live blocks until target segments hold nothing live,
+   * then checkpoint so they can be reused.
+   */
+  void clean_segments(int target){
+    cleaning = 1;
+    vector<int> owners;
+    while(1){
+      int free_count = 0;
+      int victim = -1;
+      for(int seg=0;seg<segment_count;++seg){
+        if(seg == head_segment){
+          continue;
+        }
+        if(segment_live[seg] == 0){
+          ++free_count;
+        }else if(segment_live[seg] < SEGMENT_BLOCKS && (victim < 0 || segment_live[seg] < segment_live[victim])){
+          victim = seg;
+        }
+      }
+      if(free_count >= target || victim < 0){
+        break;
+      }
+      // Rewrite every inode owning a block in victim, moving its blocks in victim along with it
+      int start = Geometry::block_start+victim*SEGMENT_BLOCKS;
+      owners.clear();
+      for(int b=0;b<SEGMENT_BLOCKS;++b){
+        int owner = block_owner[start+b-Geometry::block_start];
+        if(owner != 0){
+          owners.push_back(abs(owner));
+        }
+      }
+      sort(owners.begin(), owners.end());
+      owners.erase(unique(owners.begin(), owners.end()), owners.end());
+      for(int i=0;i<owners.size();++i){
+        // Uncached inodes are read into a buffer rather than cached, since this runs inside allocations
+        // of calls holding pointers into the cache, which must not grow or move
+        int slot = inode_slot[owners[i]-Geometry::inode_start];
+        int block_count = 0;
+        struct inode_data* map = clean_map.data();
+        if(slot >= 0){
+          block_count = inode_cache[slot].block_count;
+          map = cache_map(slot);
+        }else{
+          disk_seek(inode_offset(owners[i]));
+          disk_read(&block_count, sizeof(block_count), 1);
+          block_count = max(0, min(block_count, Geometry::max_inode_blocks));
+          disk_read(map, sizeof(struct inode_data), block_count);
+        }
+        // Moving blocks whose inode then cannot be stored would leave the stored inode on freed blocks
+        int moves = 1;
+        for(int j=0;j<block_count;++j){
+          moves += map[j].block_pos >= start && map[j].block_pos < start+SEGMENT_BLOCKS;
+        }
+        if(log_room(1) < moves){
+          break;
+        }
+        for(int j=0;j<block_count;++j){
+          if(map[j].block_pos >= start && map[j].block_pos < start+SEGMENT_BLOCKS){
+            int pos = copy_block(map[j].block_pos, map[j].block_filled, owners[i], 1);
+            if(pos >= 0){
+              map[j].block_pos = pos;
+            }
+          }
+        }
+        if(slot >= 0){
+          write_inode(slot, 0);
+        }else{
+          store_inode(owners[i], block_count, map);
+        }
+      }
+      stats.add(IO_SEGMENTS_CLEANED, 1);
+      if(segment_live[victim] > 0){
+        // Log ran out while moving blocks
+        break;
+      }
+    }
+    write_checkpoint();
+    cleaning = 0;
+  }
+
+  /*
+   * Function to make everything written so far durable, unless mounted without durability.
+   *
+   * Retval:
+   * -1 -- Sync failed
+   * 0 -- Synced, or not needed
+   */
+  int checkpoint_barrier(){
+    if(durability == DURABILITY_NONE){
+      return 0;
+    }
+    // Writers are kept out by fs_lock, so nothing written after this sync starts is missed
+    dirty = 0;
+    if(storage.sync() < 0){
+      dirty = 1;
+      return -1;
+    }
+    stats.add(IO_SYNC_CALLS, 1);
+    return 0;
+  }
+
+  /*
+   * Function to write file list, changed parts of inode map and log head to the slot not holding the last
+   * checkpoint, so a crash part way leaves the last one whole. Unless mounted without durability, the slot is
+   * synced before its header, and the header before segments whose blocks died become clean and can be reused.
+   */
+  void write_checkpoint(){
+    int slot = 1-checkpoint_slot;
+    if(file_list_dirty){
+      list_stale = (1<<CHECKPOINT_SLOTS)-1;
+      file_list_dirty = 0;
+    }
+    if(list_stale & (1<<slot)){
+      write_super_block(Geometry::offset(list_start(slot)));
+      list_stale &= ~(1<<slot);
+    }
+    for(int b=0;b<imap_blocks;++b){
+      if(imap_dirty[b] & (1<<slot)){
+        int per_block = Geometry::block_size/sizeof(int);
+        int count = min(per_block, inode_count-b*per_block);
+        disk_seek(Geometry::offset(imap_slot_start(slot)+b));
+        disk_write(&imap[b*per_block], sizeof(int), count);
+        imap_dirty[b] &= ~(1<<slot);
+      }
+    }
+    if(checkpoint_barrier() < 0){
+      return;
+    }
+    struct log_header header;
+    header.magic = LOG_MAGIC;
+    header.layout = LAYOUT_LOG;
+    header.head_segment = head_segment;
+    header.head_offset = head_offset;
+    header.sequence = ++checkpoint_sequence;
+    disk_seek(header_offset(slot));
+    disk_write(&header, sizeof(header), 1);
+    checkpoint_slot = slot;
+    log_blocks_since_checkpoint = 0;
+    if(checkpoint_barrier() < 0){
+      return;
+    }
+    for(int seg=0;seg<segment_count;++seg){
+      if(segment_live[seg] == 0 && seg != head_segment){
+        segment_clean[seg] = 1;
+      }
+    }
+    stats.add(IO_CHECKPOINTS, 1);
+  }
+
+  /*
+   * Function to finish an update: checkpoint in log layout if enough was logged, then sync in per op mode.
+   */
+  void end_update(){
+    update_open = 0;
+    if(layout == LAYOUT_LOG){
+      release_deferred();
+      if(log_blocks_since_checkpoint >= CHECKPOINT_BLOCKS){
+        write_checkpoint();
+      }
+    }
+    sync_for_mode(DURABILITY_PER_OP);
+  }
+
+  /*
+   * Function to read layout header and inode map of mounted disk.
+   */
+  void read_layout(){
+    struct log_header headers[CHECKPOINT_SLOTS];
+    memset(headers, 0, sizeof(headers));
+    for(int slot=0;slot<CHECKPOINT_SLOTS;++slot){
+      disk_seek(header_offset(slot));
+      disk_read(&headers[slot], sizeof(headers[slot]), 1);
+    }
+    checkpoint_slot = newest_checkpoint(headers);
+    layout = (checkpoint_slot < 0) ? LAYOUT_BLOCK : LAYOUT_LOG;
+    head_segment = -1;
+    head_offset = 0;
+    head_reserved = 0;
+    file_list_dirty = 0;
+    list_stale = 0;
+    log_blocks_since_checkpoint = 0;
+    deferred_frees.clear();
+    if(layout == LAYOUT_LOG){
+      struct log_header& header = headers[checkpoint_slot];
+      head_segment = header.head_segment;
+      head_offset = header.head_offset;
+      head_reserved = 0;
+      checkpoint_sequence = header.sequence;
+      // Other slot may hold anything, so all of it is written at next checkpoint
+      list_stale = 1<<(1-checkpoint_slot);
+      imap.assign(inode_count, 0);
+      imap_dirty.assign(imap_blocks, list_stale);
+      disk_seek(Geometry::offset(imap_slot_start(checkpoint_slot)));
+      disk_read(imap.data(), sizeof(int), inode_count);
+      block_buffer.resize(Geometry::block_size);
+      clean_map.resize(Geometry::max_inode_blocks);
+    }
+  }
+
+  /*
+   * Function to get pointer to a block's bytes, from mapped disk if possible, else read into buffer.
+   * Safe to call from several threads while io_lock() is held by caller of search.
+   */
+  const char* block_data(int block_pos, int length, char* buffer){
+    const char* data = storage.mapped(Geometry::offset(block_pos));
+    if(data != NULL){
+      return data;
+    }
+    stats.add(IO_READ_CALLS, 1);
+    stats.add(IO_BYTES_READ, storage.read_at(buffer, length, Geometry::offset(block_pos)));
+    return buffer;
+  }
+
+  /*
+   * Function to tell if a failed kernel copy call cannot work for these descriptors, so the next way should be tried.
+   */
+  static int copy_unsupported(){
+    return errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP || errno == ESPIPE;
+  }
+
+  /*
+   * Function to copy bytes of disk at given offset to out_fd at its current position.
+   * Bytes are moved by copy_file_range, else sendfile, so they never enter user space.
+   * A disk in memory is written out straight from memory.
+   *
+   * Retval:
+   * Number of bytes copied (less than length if out_fd failed)
+   */
+  long copy_out(long offset, long length, int out_fd){
+    int disk_fd = storage.native_fd();
+    long done = 0;
+    if(disk_fd < 0){
+      const char* data = storage.mapped(offset);
+      while(done < length){
+        ssize_t res = write(out_fd, data+done, length-done);
+        if(res < 0 && errno == EINTR){
+          continue;
+        }
+        if(res <= 0){
+          break;
+        }
+        done += res;
+      }
+      stats.add(IO_WRITE_CALLS, 1);
+      stats.add(IO_BYTES_READ, done);
+      return done;
+    }
+    int use_sendfile = 0;
+    while(done < length){
+      ssize_t res;
+      if(!use_sendfile){
+        loff_t in_offset = offset+done;
+        res = copy_file_range(disk_fd, &in_offset, out_fd, NULL, length-done, 0);
+        if(res < 0 && copy_unsupported()){
+          use_sendfile = 1;
+          continue;
+        }
+      }else{
+        off_t in_offset = offset+done;
+        res = sendfile(out_fd, disk_fd, &in_offset, length-done);
+      }
+      if(res < 0 && errno == EINTR){
+        continue;
+      }
+      if(res <= 0){
+        break;
+      }
+      done += res;
+    }
+    stats.add(IO_READ_CALLS, 1);
+    stats.add(IO_BYTES_READ, done);
+    stats.add(IO_KERNEL_COPY_BYTES, done);
+    return done;
+  }
+
+  /*
+   * Function to copy up to length bytes from in_fd at its current position into disk at given offset.
+   * Bytes are moved by copy_file_range, sendfile or splice (in_fd a pipe), trying them in that order,
+   * and only read through a buffer if none of them works for in_fd. A disk in memory is read into directly.
+   *
+   * Retval:
+   * Number of bytes copied (less than length at end of input)
+   */
+  long copy_in(long offset, long length, int in_fd){
+    int disk_fd = storage.native_fd();
+    long done = 0;
+    dirty.store(1, memory_order_relaxed);
+    if(disk_fd < 0){
+      char* data = (char*)storage.mapped(offset);
+      while(done < length){
+        ssize_t res = read(in_fd, data+done, length-done);
+        if(res < 0 && errno == EINTR){
+          continue;
+        }
+        if(res <= 0){
+          break;
+        }
+        done += res;
+      }
+      stats.add(IO_WRITE_CALLS, 1);
+      stats.add(IO_BYTES_WRITTEN, done);
+      return done;
+    }
+    long kernel_bytes = 0;
+    int method = 0;
+    vector<char> buffer;
+    while(done < length){
+      ssize_t res;
+      loff_t out_offset = offset+done;
+      if(method == 0){
+        res = copy_file_range(in_fd, NULL, disk_fd, &out_offset, length-done, 0);
+      }else if(method == 1){
+        // sendfile writes at file position of disk_fd
+        lseek(disk_fd, out_offset, SEEK_SET);
+        res = sendfile(disk_fd, in_fd, NULL, length-done);
+      }else if(method == 2){
+        res = splice(in_fd, NULL, disk_fd, &out_offset, length-done, 0);
+      }else{
+        buffer.resize(length-done);
+        res = read(in_fd, buffer.data(), length-done);
+        if(res > 0){
+          res = pwrite(disk_fd, buffer.data(), res, out_offset);
+        }
+      }
+      if(res < 0 && method < 3 && copy_unsupported()){
+        ++method;
+        continue;
+      }
+      if(res < 0 && errno == EINTR){
+        continue;
+      }
+      if(res <= 0){
+        break;
+      }
+      done += res;
+      if(method < 3){
+        kernel_bytes += res;
+      }
+    }
+    stats.add(IO_WRITE_CALLS, 1);
+    stats.add(IO_BYTES_WRITTEN, done);
+    stats.add(IO_KERNEL_COPY_BYTES, kernel_bytes);
+    return done;
+  }
+
+  /*
+   * Function to find pattern in one file, reading its inode from cache if cached.
+   * Bytes of the last length-1 bytes are carried from block to block, so matches across blocks are found.
+   */
+  void search_file(int inode_pos, const char* pattern, int length, int limit, vector<char>& buffer, vector<char>& window,
+    vector<struct inode_data>& map_copy, vector<int>& offsets){
+    static const char zero_block[Geometry::block_size] = {0};
+    int block_count;
+    const struct inode_data* map;
+    int slot = inode_slot[inode_pos-Geometry::inode_start];
+    if(slot >= 0){
+      block_count = inode_cache[slot].block_count;
+      map = cache_map(slot);
+    }else{
+      storage.read_at(&block_count, sizeof(block_count), inode_offset(inode_pos));
+      block_count = max(0, min(block_count, Geometry::max_inode_blocks));
+      storage.read_at(map_copy.data(), block_count*sizeof(struct inode_data), inode_offset(inode_pos)+sizeof(int));
+      map = map_copy.data();
+    }
+    window.clear();
+    int file_offset = 0;
+    for(int j=0;j<block_count&&offsets.size()<limit;++j){
+      int filled = max(0, min(map[j].block_filled, Geometry::block_size));
+      const char* data = (map[j].block_pos == 0) ? zero_block : block_data(map[j].block_pos, filled, buffer.data());
+      // Matches starting in carried bytes
+      if(!window.empty()){
+        int carried = window.size();
+        window.insert(window.end(), data, data+min(filled, length-1));
+        vector<int> found;
+        find_all(window.data(), window.size(), pattern, length, file_offset-carried, found, INT_MAX);
+        for(int k=0;k<found.size()&&found[k]<file_offset&&offsets.size()<limit;++k){
+          offsets.push_back(found[k]);
+        }
+        window.resize(carried);
+      }
+      find_all(data, filled, pattern, length, file_offset, offsets, limit);
+      // Carry last length-1 bytes
+      window.insert(window.end(), data, data+filled);
+      if(window.size() > length-1){
+        window.erase(window.begin(), window.end()-(length-1));
+      }
+      file_offset += filled;
+    }
+  }
+
+  /*
+   * Function to close all descriptors open on given inode, so they don't refer to a deleted file.
+   */
+  void close_inode_descriptors(int inode_pos){
+    for(int i=open_file_list.size()-1;i>=0;--i){
+      if(open_file_list[i].inode_pos == inode_pos){
+        open_file_list.erase(open_file_list.begin()+i);
+      }
+    }
+    uncache_inode(inode_pos);
+  }
+public:
+  static constexpr int block_size = Geometry::block_size;
+  // Log layout geometry: inode map sits just before header at end of super region
+  static constexpr int inode_count = Geometry::inode_end-Geometry::inode_start+1;
+  static constexpr int imap_blocks = (inode_count*sizeof(int)+Geometry::block_size-1)/Geometry::block_size;
+  static constexpr int imap_start = Geometry::super_end-imap_blocks;
+  static constexpr int list_blocks = (sizeof(int)+(long)inode_count*sizeof(struct file_info)+Geometry::block_size-1)/Geometry::block_size;
+  static constexpr int segment_count = (Geometry::block_end-Geometry::block_start+1)/SEGMENT_BLOCKS;
+  // Log layout needs room in super region for a file list and inode map per checkpoint slot and the headers,
+  // and spare segments for cleaning
+  static constexpr bool log_layout_fits = CHECKPOINT_SLOTS*list_blocks <= imap_start-(CHECKPOINT_SLOTS-1)*imap_blocks-Geometry::super_start
+    && CHECKPOINT_SLOTS*HEADER_SLOT_BYTES <= Geometry::block_size && segment_count > 2*LOG_RESERVE_SEGMENTS;
+
+  // Where each checkpoint slot keeps its file list, inode map and header. Slot 0 uses the places of a single checkpoint.
+  static constexpr int list_start(int slot){
+    return Geometry::super_start+slot*list_blocks;
+  }
+
+  static constexpr int imap_slot_start(int slot){
+    return imap_start-slot*imap_blocks;
+  }
+
+  static constexpr long header_offset(int slot){
+    return Geometry::offset(Geometry::super_end)+slot*HEADER_SLOT_BYTES;
+  }
+
+  /*
+   * Function to find slot holding the last checkpoint.
+   *
+   * Retval:
+   * -1 -- No valid header, so disk has block layout
+   * Non negative integer -- Slot of valid header with highest sequence
+   */
+  static int newest_checkpoint(struct log_header* headers){
+    int slot = -1;
+    for(int s=0;s<CHECKPOINT_SLOTS;++s){
+      if(headers[s].magic == LOG_MAGIC && headers[s].layout == LAYOUT_LOG && (slot < 0 || headers[s].sequence > headers[slot].sequence)){
+        slot = s;
+      }
+    }
+    return slot;
+  }
+
+  BasicFileSystem(){
+    file_descriptor_count = 0;
+    trace_fp = NULL;
+    durability = DURABILITY_NONE;
+    flush_interval_ms = FLUSH_INTERVAL_MS;
+    dirty = 0;
+    flusher_stop = 0;
+    layout = LAYOUT_BLOCK;
+    head_segment = -1;
+    head_offset = 0;
+    head_reserved = 0;
+    checkpoint_sequence = 0;
+    log_blocks_since_checkpoint = 0;
+    file_list_dirty = 0;
+    list_stale = 0;
+    checkpoint_slot = 0;
+    cleaning = 0;
+    update_open = 0;
+    cleaner_stop = 0;
+    reset_inode_cache();
+    build_alloc_groups();
+  }
+
+  ~BasicFileSystem(){
+    stop_cleaner();
+    stop_flusher();
+    stop_trace();
+  }
+
+  /*
+   * Function to start recording every public file call into a trace file.
+   * Header holds layout and durability of mounted disk, and is rewritten if a disk is mounted later.
+   *
+   * Params:
+   * trace_name -- string
+   *
+   * Retval:
+   * -1 -- Failed to open trace file
+   * 0 -- Tracing started
+   */
+  int start_trace(char* trace_name){
+    stop_trace();
+    trace_fp = fopen(trace_name, "wb");
+    if(trace_fp == NULL){
+      return -1;
+    }
+    write_trace_header();
+    trace_start = chrono::steady_clock::now();
+    return 0;
+  }
+
+  /*
+   * Function to stop tracing and close trace file.
+   *
+   * Retval:
+   * -1 -- Tracing was not on
+   * 0 -- Tracing stopped
+   */
+  int stop_trace(){
+    if(trace_fp == NULL){
+      return -1;
+    }
+    fclose(trace_fp);
+    trace_fp = NULL;
+    return 0;
+  }
+
+  /*
+   * Function to create an empty disk of size Geometry::disk_size.
+   *
+   * Params:
+   * disk_name -- string
+   * disk_layout -- disk_layout
+   *   LAYOUT_BLOCK -- Inodes and blocks are updated in place
+   *   LAYOUT_LOG -- Data and inodes are appended to a log of segments, with the inode map checkpointed
+   *     to the super region and a background cleaner reclaiming segments
+   *
+   * Retval:
+   * -1 -- Failed to create disk (or geometry too small for log layout)
+   * 0 -- Disk with given disk name exists
+   * 1 -- Disk created successfully
+   */
+  int create_disk(char* disk_name, int disk_layout = LAYOUT_BLOCK){
+    if(disk_layout == LAYOUT_LOG && !log_layout_fits){
+      return -1;
+    }
+    int res = Storage::create(disk_name, Geometry::disk_size);
+    if(res == 1 && disk_layout == LAYOUT_LOG){
+      Storage disk;
+      if(disk.open_disk(disk_name) < 0){
+        return -1;
+      }
+      struct log_header header;
+      header.magic = LOG_MAGIC;
+      header.layout = LAYOUT_LOG;
+      header.head_segment = -1;
+      header.head_offset = 0;
+      header.sequence = 0;
+      disk.seek(header_offset(0));
+      disk.write(&header, sizeof(header));
+      disk.close_disk();
+    }
+    return res;
+  }
+
+  /*
+   * Function to open disk file.
+   *
+   * Params:
+   * disk_name -- string
+   * mode -- durability_mode
+   *   DURABILITY_NONE -- Data is synced only by explicit fsync and at unmount
+   *   DURABILITY_PERIODIC -- Background thread syncs every interval_ms if anything was written
+   *   DURABILITY_ON_CLOSE -- close_file syncs
+   *   DURABILITY_PER_OP -- Every create, delete, write and append syncs before returning
+   * interval_ms -- int, used in periodic mode
+   *
+   * Retval:
+   * -1 -- Failed to mount disk
+   * 0 -- Successfully mounted disk
+   */
+  int mount_disk(char* disk_name, int mode = DURABILITY_NONE, int interval_ms = FLUSH_INTERVAL_MS){
+    // Open corresponding disk
+    if(storage.is_open() || storage.open_disk(disk_name) < 0){
+      return -1;
+    }
+    read_layout();
+    get_files_in_disk();
+    build_alloc_groups();
+    durability = mode;
+    flush_interval_ms = interval_ms;
+    dirty = 0;
+    write_trace_header();
+    if(mode == DURABILITY_PERIODIC){
+      flusher_stop = 0;
+      flusher = thread(&BasicFileSystem::run_flusher, this);
+    }
+    if(layout == LAYOUT_LOG){
+      cleaner_stop = 0;
+      cleaner = thread(&BasicFileSystem::run_cleaner, this);
+    }
+    return 0;
+  }
+
+  /*
+   * Function to close disk file.
+   *
+   * Params:
+   * disk_name -- string
+   *
+   * Retval:
+   * -1 -- Failed to unmount disk (most likely, disk wasn't mounted)
+   * 0 -- Successfully unmounted disk
+   */
+  int unmount_disk(){
+    if(!storage.is_open()){
+      return -1;
+    }
+    stop_cleaner();
+    stop_flusher();
+    sync_dirty();
+    lock_guard<recursive_mutex> guard(fs_lock);
+    open_file_list.clear();
     file_descriptor_count = 0;
     file_list.clear();
-    fclose(fp);
+    reset_inode_cache();
+    storage.close_disk();
+    layout = LAYOUT_BLOCK;
     return 0;
   }
 
   /*
-   * Function to get the first available inode in disk.
+   * Function to read super block and get list of files.
+   */
+  void get_files_in_disk(){
+    disk_seek(layout == LAYOUT_LOG ? Geometry::offset(list_start(checkpoint_slot)) : 0);
+    int file_count;
+    disk_read(&file_count, sizeof(file_count), 1);
+    // cout<<"no of files: "<<file_count<<endl;
+    for(int i=0;i<file_count;++i){
+      struct file_info temp;
+      disk_read(&temp, sizeof(temp), 1);
+      file_list.push_back(temp);
+    }
+  }
+
+  /*
+   * Function to write filenames and corresponding inode position to super block of disk.
+   */
+  void update_super_block(){
+    if(layout == LAYOUT_LOG){
+      // Written with next checkpoint
+      file_list_dirty = 1;
+      return;
+    }
+    write_super_block();
+  }
+
+  void write_super_block(long offset = 0){
+    disk_seek(offset);
+    int count = file_list.size();
+    disk_write(&count, sizeof(count), 1);
+    for(int i=0;i<file_list.size();++i){
+      disk_write(&file_list[i], sizeof(file_list[i]), 1);
+    }
+  }
+
+  /*
+   * Function to create file with given filename on disk.
+   * Parameters:
+   * file_name -- char array
    *
    * Retval:
-   * -1 -- Empty inode not available
-   * Non negative integer -- Empty inode position
-   */
-  int get_empty_inode(){
-    int pos = -1;
-    for(int i=INODE_START;i<=INODE_END;++i){
-      fseek(fp, (i-1)*BLOCK_SIZE, 0);
-      int check;
-      fread(&check, sizeof(check), 1, fp);
-      if(check == 0){
-        pos = i;
+   * -1 -- Memory not available to create file
+   * 0 -- Duplicate file name
+   * 1 -- File created successfully
+   */
+  int add_file_to_disk(char* file_name){
+    OpTimer timer(stats, OP_CREATE);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_CREATE, -1, 0, file_name);
+    return create_file(file_name);
+  }
+
+  /*
+   * Function to create file like add_file_to_disk without tracing the call, for calls which trace themselves.
+   */
+  int create_file(char* file_name){
+    // Check if file exists
+    for(int i=0;i<file_list.size();++i){
+      if(strcmp(file_list[i].file_name, file_name) == 0){
+        return 0;
+      }
+    }
+    // Initialise struct to hold file info
+    struct file_info temp;
+    strcpy(temp.file_name, file_name);
+    // Get memory for file
+    int inode_pos = alloc_inode();
+    // Files start as an empty hole in log layout, so creating one only logs its inode
+    int block_pos = (inode_pos < 0) ? -1 : (layout == LAYOUT_LOG) ? 0 : alloc_block(inode_pos, 0);
+
+    temp.inode_pos = inode_pos;
+    // Check if memory was obtained
+    if(inode_pos < 0 || block_pos < 0){
+      if(inode_pos >= 0){
+        mark_position(inode_groups, inode_pos, 0);
+      }
+      return -1;
+    }
+
+    // Add placeholder on block
+    if(block_pos != 0){
+      disk_seek(Geometry::offset(block_pos));
+      int placeholder = 1;
+      disk_write(&placeholder, sizeof(placeholder), 1);
+    }
+    // Write block info to inode
+    struct inode_data data;
+    data.block_pos = block_pos;
+    data.block_filled = 0;
+    store_inode(inode_pos, 1, &data);
+
+    // cout<<"file name: "<<file_name<<" inode: "<<inode_pos<<" block: "<<block_pos<<endl;
+
+    // Add file to file list
+    file_list.push_back(temp);
+    // Write data to super block
+    update_super_block();
+    end_update();
+    return 1;
+  }
+
+  /*
+   * Function to delete given file from disk.
+   * Parameters:
+   * file_name -- char array
+   *
+   * Retval:
+   * 0 -- Failed to remove file
+   * 1 -- Successfully removed file
+   */
+  int remove_file_from_disk(char* file_name){
+    OpTimer timer(stats, OP_DELETE);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_DELETE, -1, 0, file_name);
+    // Initialise flag
+    int flag = 0;
+    // Check if file exists
+    for(int i=0;i<file_list.size();++i){
+      if(strcmp(file_list[i].file_name, file_name) == 0){
+        // Get inode position
+        int inode_pos = file_list[i].inode_pos;
+        // Get block positions
+        int slot = cache_inode(inode_pos);
+        struct inode_data* map = cache_map(slot);
+
+        // Free blocks
+        for(int j=0;j<inode_cache[slot].block_count;++j){
+          if(map[j].block_pos != 0){
+            free_block(map[j].block_pos);
+          }
+        }
+        free_inode(inode_pos);
+        close_inode_descriptors(inode_pos);
+
+        file_list.erase(file_list.begin()+i);
+        flag = 1;
+        break;
+      }
+    }
+
+    update_super_block();
+    end_update();
+    return flag;
+  }
+
+  /*
+   * Function to create a batch of files with one allocator pass and one super block update.
+   * The batch is all-or-nothing: if any name fails, no file is created.
+   * Parameters:
+   * file_names -- array of char arrays
+   * count -- int
+   * results -- int array of size count, filled with result for each name
+   *   -2 -- Not created because another name in batch failed
+   *   -1 -- Memory not available to create file
+   *   0 -- Duplicate file name
+   *   1 -- File created successfully
+   *
+   * Retval:
+   * Number of files created
+   */
+  int add_files_to_disk(char** file_names, int count, int* results){
+    OpTimer timer(stats, OP_CREATE);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_batch(TRACE_CREATE_BATCH, file_names, count);
+    // Check for duplicates against disk and within batch
+    unordered_set<string> names;
+    for(int i=0;i<file_list.size();++i){
+      names.insert(file_list[i].file_name);
+    }
+    int failed = 0;
+    for(int i=0;i<count;++i){
+      if(names.insert(file_names[i]).second){
+        results[i] = 1;
+      }else{
+        results[i] = 0;
+        failed = 1;
+      }
+    }
+    // Get memory for all files, each block following the previous one
+    vector<int> inode_list;
+    vector<int> block_list;
+    for(int i=0;i<count&&!failed;++i){
+      int inode_pos = alloc_inode();
+      int block_pos = (inode_pos < 0) ? -1 : (layout == LAYOUT_LOG) ? 0 : alloc_block(inode_pos, block_list.empty() ? 0 : block_list.back());
+      if(inode_pos < 0 || block_pos < 0){
+        // Mark names which did not get memory and give back what was taken
+        if(inode_pos >= 0){
+          mark_position(inode_groups, inode_pos, 0);
+        }
+        for(int j=0;j<inode_list.size();++j){
+          mark_position(inode_groups, inode_list[j], 0);
+          if(block_list[j] != 0){
+            mark_position(block_groups, block_list[j], 0);
+          }
+        }
+        for(int j=i;j<count;++j){
+          results[j] = -1;
+        }
+        failed = 1;
         break;
       }
+      inode_list.push_back(inode_pos);
+      block_list.push_back(block_pos);
+    }
+    if(failed){
+      for(int i=0;i<count;++i){
+        if(results[i] == 1){
+          results[i] = -2;
+        }
+      }
+      return 0;
+    }
+
+    // Write inodes, then placeholders on blocks, in increasing position.
+    // Groups wrap around, so positions are not taken in order.
+    vector<pair<int, int> > order;
+    for(int i=0;i<count;++i){
+      order.push_back(make_pair(inode_list[i], block_list[i]));
+    }
+    sort(order.begin(), order.end());
+    for(int i=0;i<count;++i){
+      struct inode_data data;
+      data.block_pos = order[i].second;
+      data.block_filled = 0;
+      store_inode(order[i].first, 1, &data);
+    }
+    vector<int> sorted_blocks(block_list);
+    sort(sorted_blocks.begin(), sorted_blocks.end());
+    for(int i=0;i<count&&layout!=LAYOUT_LOG;++i){
+      int placeholder = 1;
+      disk_seek(Geometry::offset(sorted_blocks[i]));
+      disk_write(&placeholder, sizeof(placeholder), 1);
+    }
+
+    // Add files to file list
+    for(int i=0;i<count;++i){
+      struct file_info temp;
+      strcpy(temp.file_name, file_names[i]);
+      temp.inode_pos = inode_list[i];
+      file_list.push_back(temp);
+    }
+    update_super_block();
+    end_update();
+    return count;
+  }
+
+  /*
+   * Function to delete a batch of files with one super block update.
+   * The batch is all-or-nothing: if any name is not found, no file is removed.
+   * Parameters:
+   * file_names -- array of char arrays
+   * count -- int
+   * results -- int array of size count, filled with result for each name
+   *   -2 -- Not removed because another name in batch failed
+   *   0 -- No such file (or name repeated in batch)
+   *   1 -- Successfully removed file
+   *
+   * Retval:
+   * Number of files removed
+   */
+  int remove_files_from_disk(char** file_names, int count, int* results){
+    OpTimer timer(stats, OP_DELETE);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_batch(TRACE_DELETE_BATCH, file_names, count);
+    // Check each name exists on disk and appears once in batch
+    unordered_set<string> existing;
+    for(int i=0;i<file_list.size();++i){
+      existing.insert(file_list[i].file_name);
+    }
+    unordered_set<string> names;
+    int failed = 0;
+    for(int i=0;i<count;++i){
+      if(existing.find(file_names[i]) != existing.end() && names.insert(file_names[i]).second){
+        results[i] = 1;
+      }else{
+        results[i] = 0;
+        failed = 1;
+      }
+    }
+    if(failed){
+      for(int i=0;i<count;++i){
+        if(results[i] == 1){
+          results[i] = -2;
+        }
+      }
+      return 0;
+    }
+    vector<int> remove_flag(file_list.size(), 0);
+    vector<int> inode_list;
+    for(int i=0;i<file_list.size();++i){
+      if(names.find(file_list[i].file_name) != names.end()){
+        remove_flag[i] = 1;
+        inode_list.push_back(file_list[i].inode_pos);
+      }
+    }
+
+    // Collect blocks of all files
+    sort(inode_list.begin(), inode_list.end());
+    vector<int> block_list;
+    for(int i=0;i<inode_list.size();++i){
+      int slot = cache_inode(inode_list[i]);
+      struct inode_data* map = cache_map(slot);
+      for(int j=0;j<inode_cache[slot].block_count;++j){
+        if(map[j].block_pos != 0){
+          block_list.push_back(map[j].block_pos);
+        }
+      }
+      close_inode_descriptors(inode_list[i]);
+    }
+    sort(block_list.begin(), block_list.end());
+
+    // Free inodes, then blocks, in increasing position
+    for(int i=0;i<inode_list.size();++i){
+      free_inode(inode_list[i]);
+    }
+    for(int i=0;i<block_list.size();++i){
+      free_block(block_list[i]);
+    }
+
+    // Remove files from file list
+    vector<struct file_info> remaining;
+    for(int i=0;i<file_list.size();++i){
+      if(!remove_flag[i]){
+        remaining.push_back(file_list[i]);
+      }
     }
-
-    return pos;
+    file_list.swap(remaining);
+    update_super_block();
+    end_update();
+    return inode_list.size();
   }
 
   /*
-   * Function to get the first available block in disk.
+   * Function to get layout of mounted disk.
    *
    * Retval:
-   * -1 -- Empty block not available
-   * Non negative integer -- Empty block position
-   */
-  int get_empty_block(){
-    int pos = -1;
-    for(int i=BLOCK_START;i<=BLOCK_END;++i){
-      fseek(fp, (i-1)*BLOCK_SIZE, 0);
-      int check;
-      fread(&check, sizeof(check), 1, fp);
-      if(check == 0){
-        pos = i;
-        break;
-      }
-    }
-
-    return pos;
+   * LAYOUT_BLOCK or LAYOUT_LOG
+   */
+  int get_layout(){
+    return layout;
   }
 
   /*
-   * Function to read super block and get list of files.
+   * Function to get number of free data blocks.
    */
-  void get_files_in_disk(){
-    fseek(fp, 0, 0);
-    int file_count;
-    fread(&file_count, sizeof(file_count), 1, fp);
-    // cout<<"no of files: "<<file_count<<endl;
-    for(int i=0;i<file_count;++i){
-      struct file_info temp;
-      fread(&temp, sizeof(temp), 1, fp);
-      file_list.push_back(temp);
+  int get_free_block_count(){
+    lock_guard<recursive_mutex> guard(fs_lock);
+    int count = 0;
+    for(int g=0;g<ALLOC_GROUPS;++g){
+      count += block_groups[g].free_count;
     }
+    return count;
   }
 
   /*
-   * Function to write filenames and corresponding inode position to super block of disk.
+   * Function to find files containing a pattern. Blocks are scanned in place from mapped disk, or read
+   * straight into a per thread buffer, with files shared out among threads. Matches may cross blocks and holes.
+   * Parameters:
+   * pattern -- char array
+   * options -- search_options
+   *
+   * Retval:
+   * Files with a match, in order of file list, each with offsets of matches in increasing order
    */
-  void update_super_block(){
-    fseek(fp, 0, 0);
-    int count = file_list.size();
-    fwrite(&count, sizeof(count), 1, fp);
+  vector<struct search_result> search(const char* pattern, struct search_options options = search_options()){
+    OpTimer timer(stats, OP_SEARCH);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_SEARCH, options.thread_count, options.max_matches, pattern);
+    vector<struct search_result> results;
+    int length = strlen(pattern);
+    if(length == 0 || !storage.is_open()){
+      return results;
+    }
+    int limit = (options.max_matches > 0) ? options.max_matches : INT_MAX;
+    int thread_count = (options.thread_count > 0) ? options.thread_count : thread::hardware_concurrency();
+    thread_count = max(1, min(thread_count, (int)file_list.size()));
+    vector<vector<int> > found(file_list.size());
+    atomic<int> next_file(0);
+    auto worker = [&]{
+      vector<char> buffer(Geometry::block_size);
+      vector<char> window;
+      vector<struct inode_data> map_copy(Geometry::max_inode_blocks);
+      for(int i=next_file++;i<file_list.size();i=next_file++){
+        search_file(file_list[i].inode_pos, pattern, length, limit, buffer, window, map_copy, found[i]);
+      }
+    };
+    vector<thread> threads;
+    for(int t=1;t<thread_count;++t){
+      threads.push_back(thread(worker));
+    }
+    worker();
+    for(int t=0;t<threads.size();++t){
+      threads[t].join();
+    }
     for(int i=0;i<file_list.size();++i){
-      fwrite(&file_list[i], sizeof(file_list[i]), 1, fp);
+      if(!found[i].empty()){
+        struct search_result res;
+        strcpy(res.file_name, file_list[i].file_name);
+        res.offsets.swap(found[i]);
+        results.push_back(res);
+      }
     }
+    return results;
   }
 
   /*
-   * Function to create file with given filename on disk.
+   * Function to write contents of an open file to out_fd, starting at out_fd's current position.
+   * Runs of blocks which follow each other on disk are moved in one kernel side copy, without passing through
+   * user space. Holes are skipped with a seek if out_fd is a regular file, else written as zeroes.
    * Parameters:
-   * file_name -- char array
+   * fd -- int
+   * out_fd -- int, host file, pipe or socket
    *
    * Retval:
-   * -1 -- Memory not available to create file
-   * 0 -- Duplicate file name
-   * 1 -- File created successfully
+   * -1 -- No file open with given file descriptor
+   * Non negative integer -- Number of bytes exported (less than file size if out_fd failed)
    */
-  int add_file_to_disk(char* file_name){
-    // Check if file exists
-    for(int i=0;i<file_list.size();++i){
-      if(strcmp(file_list[i].file_name, file_name) == 0){
-        return 0;
+  long export_file(int fd, int out_fd){
+    OpTimer timer(stats, OP_EXPORT);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_EXPORT, fd, 0, NULL);
+    int slot = get_open_slot(fd);
+    if(slot < 0){
+      return -1;
+    }
+    static const char zero_block[Geometry::block_size] = {0};
+    struct inode_cache_entry& entry = inode_cache[slot];
+    struct inode_data* map = cache_map(slot);
+    struct stat info;
+    int sparse_out = fstat(out_fd, &info) == 0 && S_ISREG(info.st_mode) && lseek(out_fd, 0, SEEK_CUR) >= 0;
+    long done = 0;
+    for(int j=0;j<entry.block_count;){
+      if(map[j].block_pos == 0){
+        long length = map[j].block_filled;
+        if(sparse_out){
+          lseek(out_fd, length, SEEK_CUR);
+          done += length;
+        }else{
+          while(length > 0){
+            ssize_t res = write(out_fd, zero_block, length);
+            if(res < 0 && errno == EINTR){
+              continue;
+            }
+            if(res <= 0){
+              return done;
+            }
+            length -= res;
+            done += res;
+          }
+        }
+        ++j;
+        continue;
+      }
+      // Extend run while blocks are full and the next one follows on disk
+      int k = j;
+      long length = map[j].block_filled;
+      while(k+1 < entry.block_count && map[k].block_filled == Geometry::block_size && map[k+1].block_pos == map[k].block_pos+1){
+        ++k;
+        length += map[k].block_filled;
+      }
+      long res = copy_out(Geometry::offset(map[j].block_pos), length, out_fd);
+      done += res;
+      if(res < length){
+        return done;
       }
+      j = k+1;
     }
-    // Initialise struct to hold file info
-    struct file_info temp;
-    strcpy(temp.file_name, file_name);
-    // Get memory for file
-    int inode_pos = get_empty_inode();
-    int block_pos = get_empty_block();
-
-    temp.inode_pos = inode_pos;
-    // Check if memory was obtained
-    if(inode_pos < 0 || block_pos < 0){
-      return -1;
+    // A trailing hole needs the file extended to the end of the export
+    if(sparse_out){
+      off_t end = lseek(out_fd, 0, SEEK_CUR);
+      if(fstat(out_fd, &info) == 0 && end > info.st_size){
+        ftruncate(out_fd, end);
+      }
     }
-
-    // Add placeholder on block
-    fseek(fp, (block_pos-1)*BLOCK_SIZE, 0);
-    int placeholder = 1;
-    fwrite(&placeholder, sizeof(placeholder), 1, fp);
-    // Write block info to inode
-    int block_count = 1;
-    struct inode_data data;
-    data.block_pos = block_pos;
-    data.block_filled = 0;
-    fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-    fwrite(&block_count, sizeof(block_count), 1, fp);
-    fwrite(&data, sizeof(data), 1, fp);
-
-    // cout<<"file name: "<<file_name<<" inode: "<<inode_pos<<" block: "<<block_pos<<endl;
-
-    // Add file to file list
-    file_list.push_back(temp);
-    // Write data to super block
-    update_super_block();
-    return 1;
+    return done;
   }
 
   /*
-   * Function to delete given file from disk.
+   * Function to create a file with given name holding everything read from in_fd, from its current position
+   * to end of input. Blocks are filled by kernel side copies straight into the disk. If in_fd is a regular file,
+   * its holes stay holes. Input past the largest file size is not read.
    * Parameters:
+   * in_fd -- int, host file, pipe or socket
    * file_name -- char array
    *
    * Retval:
-   * 0 -- Failed to remove file
-   * 1 -- Successfully removed file
+   * -2 -- Duplicate file name
+   * -1 -- Memory not available to create file
+   * Non negative integer -- Number of bytes imported (stops early if memory ran out)
    */
-  int remove_file_from_disk(char* file_name){
-    // Initialise flag
-    int flag = 0;
-    int empty = 0;
-    // Check if file exists
-    for(int i=0;i<file_list.size();++i){
-      if(strcmp(file_list[i].file_name, file_name) == 0){
-        // Get inode position
-        int inode_pos = file_list[i].inode_pos;
-        // Get block positions
-        fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-        int block_count;
-        fread(&block_count, sizeof(block_count), 1, fp);
-        // Get list of blocks
-        vector<struct inode_data> data_list;
-        for(int j=0;j<block_count;++j){
-          struct inode_data data;
-          fread(&data, sizeof(data), 1, fp);
-          data_list.push_back(data);
+  long import_file(int in_fd, char* file_name){
+    OpTimer timer(stats, OP_IMPORT);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    int res = create_file(file_name);
+    if(res <= 0){
+      trace_call(OP_IMPORT, -1, 0, file_name);
+      return (res == 0) ? -2 : -1;
+    }
+    int slot = cache_inode(file_list.back().inode_pos);
+    ++inode_cache[slot].pin_count;
+    struct inode_cache_entry& entry = inode_cache[slot];
+    struct inode_data* map = cache_map(slot);
+    struct stat info;
+    off_t in_pos = lseek(in_fd, 0, SEEK_CUR);
+    int sparse_in = in_pos >= 0 && fstat(in_fd, &info) == 0 && S_ISREG(info.st_mode);
+    long done = 0;
+    int j = 0;
+    // Cleared once a block of input is copied, so only input that was all holes is traced as zeroes
+    int zero_data = 1;
+    // Size of input is known only for regular files
+    begin_update(sparse_in ? min((off_t)Geometry::max_inode_blocks, (info.st_size-in_pos+Geometry::block_size-1)/Geometry::block_size)
+      : Geometry::max_inode_blocks);
+    for(;j<Geometry::max_inode_blocks;++j){
+      if(j > 0){
+        map[j].block_pos = 0;
+      }
+      map[j].block_filled = 0;
+      if(sparse_in){
+        if(in_pos >= info.st_size){
+          break;
         }
-
-        // Free blocks
-        for(int j=0;j<data_list.size();++j){
-          fseek(fp, (data_list[j].block_pos-1)*BLOCK_SIZE, 0);
-          fwrite(&empty, sizeof(empty), 1, fp);
+        off_t data = lseek(in_fd, in_pos, SEEK_DATA);
+        if(data < 0){
+          data = info.st_size;
+        }
+        int length = min((off_t)Geometry::block_size, info.st_size-in_pos);
+        if(data >= in_pos+length){
+          // Whole block is a hole in input
+          if(map[j].block_pos != 0){
+            free_block(map[j].block_pos);
+            map[j].block_pos = 0;
+          }
+          map[j].block_filled = length;
+          in_pos += length;
+          done += length;
+          lseek(in_fd, in_pos, SEEK_SET);
+          stats.add(IO_ZERO_BLOCKS_SKIPPED, 1);
+          continue;
+        }
+        lseek(in_fd, in_pos, SEEK_SET);
+      }
+      int allocated = 0;
+      if(map[j].block_pos == 0){
+        int pos = alloc_block(entry.inode_pos, last_block(map, j));
+        if(pos < 0){
+          break;
+        }
+        map[j].block_pos = pos;
+        allocated = 1;
+      }
+      long length = copy_in(Geometry::offset(map[j].block_pos), Geometry::block_size, in_fd);
+      if(length == 0){
+        // End of input; an empty file keeps the block it was created with
+        if(allocated){
+          free_block(map[j].block_pos);
+          map[j].block_pos = 0;
         }
-        // Free inode
-        fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-        fwrite(&empty, sizeof(empty), 1, fp);
-
-        file_list.erase(file_list.begin()+i);
-        flag = 1;
+        break;
+      }
+      map[j].block_filled = length;
+      in_pos += length;
+      done += length;
+      zero_data = 0;
+      if(length < Geometry::block_size && !sparse_in){
+        ++j;
         break;
       }
     }
+    entry.block_count = max(j, 1);
+    entry.file_size = done;
+    write_inode(slot, 0);
+    --entry.pin_count;
+    end_update();
+    // Traced once size is known, so replay can import as many bytes
+    trace_call(OP_IMPORT, -1, done, file_name, zero_data ? TRACE_ZERO_DATA : 0);
+    return done;
+  }
 
-    update_super_block();
-    return flag;
+  /*
+   * Function to get a copy of list of files on disk.
+   */
+  vector<struct file_info> get_file_list(){
+    lock_guard<recursive_mutex> guard(fs_lock);
+    return file_list;
   }
 
   void display_all_files(){
@@ -325,6 +2788,8 @@ public:
    * Non negative integer -- File descriptor to opened file
    */
   int open_file(char* file_name, int mode){
+    OpTimer timer(stats, OP_OPEN);
+    lock_guard<recursive_mutex> guard(fs_lock);
     int fd = -1;
     if(mode != 1 && mode != 2 && mode != 3){
       return -2;
@@ -337,12 +2802,15 @@ public:
         temp.mode = mode;
         temp.write_status = 0;
         temp.fd = file_descriptor_count;
+        temp.cache_slot = cache_inode(temp.inode_pos);
+        ++inode_cache[temp.cache_slot].pin_count;
         open_file_list.push_back(temp);
         fd = file_descriptor_count;
         ++file_descriptor_count;
         break;
       }
     }
+    trace_call(OP_OPEN, fd, mode, file_name);
     return fd;
   }
 
@@ -376,35 +2844,28 @@ public:
    * fd -- int
    */
   void display_file(int fd){
-    for(int i=0;i<open_file_list.size();++i){
-      if(open_file_list[i].fd == fd){
-        int inode_pos = open_file_list[i].inode_pos;
-        // Read from inode
-        vector<struct inode_data> inode_data_list;
-        fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-        int block_count;
-        fread(&block_count, sizeof(block_count), 1, fp);
-        for(int j=0;j<block_count;++j){
-          struct inode_data data;
-          fread(&data, sizeof(data), 1, fp);
-          inode_data_list.push_back(data);
-        }
-        // Read from block
-        for(int j=0;j<inode_data_list.size();++j){
-          int block_pos = inode_data_list[j].block_pos;
-          int block_filled = inode_data_list[j].block_filled;
-          fseek(fp, (block_pos-1)*BLOCK_SIZE, 0);
-          // Print contents of block
-          for(int k=0;k<block_filled;++k){
-            char ch;
-            fread(&ch, sizeof(ch), 1, fp);
-            cout<<ch;
-          }
-        }
-        cout<<endl;
-        break;
+    OpTimer timer(stats, OP_READ);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_READ, fd, -1, NULL);
+    int slot = get_open_slot(fd);
+    if(slot < 0){
+      return;
+    }
+    struct inode_cache_entry& entry = inode_cache[slot];
+    struct inode_data* map = cache_map(slot);
+    char block[Geometry::block_size];
+    for(int j=0;j<entry.block_count;++j){
+      if(map[j].block_pos == 0){
+        // Hole reads as zeroes
+        memset(block, 0, map[j].block_filled);
+        cout.write(block, map[j].block_filled);
+        continue;
       }
+      disk_seek(Geometry::offset(map[j].block_pos));
+      int res = disk_read(block, 1, map[j].block_filled);
+      cout.write(block, res);
     }
+    cout<<endl;
   }
 
   /*
@@ -414,190 +2875,278 @@ public:
    * fd -- int
    * buffer -- char array
    * buffer_size -- int
+   *
+   * Retval:
+   * Number of characters read
    */
-  void read_from_file(int fd, char* buffer, int buffer_size){
-    for(int i=0;i<open_file_list.size();++i){
-      if(open_file_list[i].fd == fd){
-        int inode_pos = open_file_list[i].inode_pos;
-        // Read from inode
-        vector<struct inode_data> inode_data_list;
-        fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-        int block_count;
-        fread(&block_count, sizeof(block_count), 1, fp);
-        for(int j=0;j<block_count;++j){
-          struct inode_data data;
-          fread(&data, sizeof(data), 1, fp);
-          inode_data_list.push_back(data);
-        }
-        // Read from block
-        for(int j=0;j<inode_data_list.size()&&j<buffer_size;++j){
-          int block_pos = inode_data_list[j].block_pos;
-          int block_filled = inode_data_list[j].block_filled;
-          fseek(fp, (block_pos-1)*BLOCK_SIZE, 0);
-          // Print contents of block
-          for(int k=0;k<block_filled;++k){
-            char ch;
-            fread(&ch, sizeof(ch), 1, fp);
-            // cout<<ch;
-            buffer[j*BLOCK_SIZE+k] = ch;
-          }
-        }
-        // cout<<endl;
-        break;
+  int read_from_file(int fd, char* buffer, int buffer_size){
+    OpTimer timer(stats, OP_READ);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_READ, fd, buffer_size, NULL);
+    int slot = get_open_slot(fd);
+    if(slot < 0){
+      return 0;
+    }
+    struct inode_cache_entry& entry = inode_cache[slot];
+    struct inode_data* map = cache_map(slot);
+    int read_count = 0;
+    for(int j=0;j<entry.block_count&&read_count<buffer_size;++j){
+      int block_filled = min(map[j].block_filled, buffer_size-read_count);
+      if(map[j].block_pos == 0){
+        // Hole reads as zeroes
+        memset(&buffer[read_count], 0, block_filled);
+        read_count += block_filled;
+        continue;
       }
+      disk_seek(Geometry::offset(map[j].block_pos));
+      read_count += disk_read(&buffer[read_count], 1, block_filled);
+    }
+    return read_count;
+  }
+
+  /*
+   * Function to get number of characters in file.
+   * Parameters:
+   * fd -- int
+   *
+   * Retval:
+   * -1 -- No file open with given file descriptor
+   * Non negative integer -- Size of file
+   */
+  int get_file_size(int fd){
+    lock_guard<recursive_mutex> guard(fs_lock);
+    int slot = get_open_slot(fd);
+    if(slot < 0){
+      return -1;
     }
+    return inode_cache[slot].file_size;
   }
 
   /*
    * Function to write a character to a file.
    * It is assumed that all checks (file exists and opened in write mode) have been done.
+   * Existing blocks are reused in order and blocks left over after the write are freed.
+   * Blocks of data which are all zero are kept as holes and take no block on disk.
    * Parameters:
    * fd -- int
    * buffer -- char array
    * buffer_size -- int
+   *
+   * Retval:
+   * Number of characters written (less than buffer_size if memory ran out)
    */
-  void write_to_file(int fd, char* buffer, int buffer_size){
-    for(int i=0;i<open_file_list.size();++i){
-      if(open_file_list[i].fd == fd){
-        int inode_pos = open_file_list[i].inode_pos;
-        // Read from inode
-        vector<struct inode_data> inode_data_list;
-        fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-        int block_count;
-        fread(&block_count, sizeof(block_count), 1, fp);
-        for(int j=0;j<block_count;++j){
-          struct inode_data data;
-          fread(&data, sizeof(data), 1, fp);
-          inode_data_list.push_back(data);
-        }
-
-        // Reset data in previous blocks
-        for(int j=0;j<inode_data_list.size();++j){
-          inode_data_list[j].block_filled = 0;
-        }
-
-        // Write buffer to file
-        int max_block_count = inode_data_list.size();
-        int current_block_counter = 0;
-        int current_block_pos = inode_data_list[0].block_pos;
-        int current_block_filled = inode_data_list[0].block_filled;
-        fseek(fp, (current_block_pos-1)*BLOCK_SIZE, 0);
-        for(int j=0;j<buffer_size;++j){
-          // Check if current block is filled
-          if(current_block_filled == BLOCK_SIZE){
-            // If next block exists, move to next block
-            if(current_block_counter < max_block_count-1){
-              // Update current block
-              ++current_block_counter;
-              current_block_pos = inode_data_list[current_block_counter].block_pos;
-              current_block_filled = inode_data_list[current_block_counter].block_filled;
-              fseek(fp, (current_block_pos-1)*BLOCK_SIZE, 0);
-            }else{
-              // Add new block
-              int res = get_empty_block();
-              if(res < 0){
-                break;
-              }else{
-                struct inode_data temp;
-                temp.block_pos = res;
-                temp.block_filled = 0;
-                inode_data_list.push_back(temp);
-                // Update current block
-                max_block_count = inode_data_list.size();
-                ++current_block_counter;
-                current_block_pos = inode_data_list[current_block_counter].block_pos;
-                current_block_filled = inode_data_list[current_block_counter].block_filled;
-                fseek(fp, (current_block_pos-1)*BLOCK_SIZE, 0);
-              }
-            }
-          }
-          fwrite(&buffer[j], sizeof(buffer[j]), 1, fp);
-          ++inode_data_list[current_block_counter].block_filled;
+  int write_to_file(int fd, char* buffer, int buffer_size){
+    OpTimer timer(stats, OP_WRITE);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_WRITE, fd, buffer_size, NULL, (trace_fp != NULL && is_zero_range(buffer, max(buffer_size, 0))) ? TRACE_ZERO_DATA : 0);
+    int slot = get_open_slot(fd);
+    if(slot < 0){
+      return 0;
+    }
+    begin_update(min(Geometry::max_inode_blocks, (buffer_size+Geometry::block_size-1)/Geometry::block_size));
+    struct inode_cache_entry& entry = inode_cache[slot];
+    struct inode_data* map = cache_map(slot);
+    int owned_count = entry.block_count;
+    int write_count = 0;
+    int j = 0;
+    while(j == 0 || write_count < buffer_size){
+      if(j == Geometry::max_inode_blocks){
+        break;
+      }
+      if(j == owned_count){
+        map[j].block_pos = 0;
+        ++owned_count;
+      }
+      int chunk = min(Geometry::block_size, buffer_size-write_count);
+      if(chunk > 0 && is_zero_range(&buffer[write_count], chunk)){
+        // Keep as hole
+        if(map[j].block_pos != 0){
+          free_block(map[j].block_pos);
+          map[j].block_pos = 0;
         }
-        // Update inode data
-        fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-        ++current_block_counter;
-        fwrite(&current_block_counter, sizeof(current_block_counter), 1, fp);
-        for(int j=0;j<current_block_counter;++j){
-          fwrite(&inode_data_list[j], sizeof(inode_data_list[j]), 1, fp);
+        stats.add(IO_ZERO_BLOCKS_SKIPPED, 1);
+      }else if(chunk > 0){
+        // Never overwrite in place in log layout. The old block is freed only once a new one is taken,
+        // so a full disk leaves the entry as it was
+        if(map[j].block_pos == 0 || layout == LAYOUT_LOG){
+          int res = alloc_block(entry.inode_pos, last_block(map, j));
+          if(res < 0){
+            break;
+          }
+          if(map[j].block_pos != 0){
+            free_block(map[j].block_pos);
+          }
+          map[j].block_pos = res;
         }
-        break;
+        disk_seek(Geometry::offset(map[j].block_pos));
+        disk_write(&buffer[write_count], 1, chunk);
+      }
+      map[j].block_filled = chunk;
+      write_count += chunk;
+      ++j;
+    }
+    // Leave file as it was if not even its first block could be written, rather than keep an entry never written
+    if(j == 0){
+      end_update();
+      return 0;
+    }
+    // Free blocks not needed any more
+    for(int k=j;k<owned_count;++k){
+      if(map[k].block_pos != 0){
+        free_block(map[k].block_pos);
       }
     }
+    entry.block_count = max(j, 1);
+    entry.file_size = write_count;
+    write_inode(slot, 0);
+    end_update();
+    return write_count;
   }
 
   /*
    * Function to append a character to a file.
    * It is assumed that all checks (file exists and opened in append mode) have been done.
+   * Writing starts at the cached tail block, and only the inode entries from the old tail on are rewritten.
+   * Blocks of data which are all zero are kept as holes, and a hole at the tail gets a block
+   * once non zero data is appended to it.
    * Parameters:
    * fd -- int
    * buffer -- char array
    * buffer_size -- int
+   *
+   * Retval:
+   * Number of characters written (less than buffer_size if memory ran out)
    */
-  void append_to_file(int fd, char* buffer, int buffer_size){
-    for(int i=0;i<open_file_list.size();++i){
-      if(open_file_list[i].fd == fd){
-        int inode_pos = open_file_list[i].inode_pos;
-        // Read from inode
-        vector<struct inode_data> inode_data_list;
-        fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-        int block_count;
-        fread(&block_count, sizeof(block_count), 1, fp);
-        for(int j=0;j<block_count;++j){
-          struct inode_data data;
-          fread(&data, sizeof(data), 1, fp);
-          inode_data_list.push_back(data);
-        }
-
-        // Write buffer to file
-        int max_block_count = inode_data_list.size();
-        int current_block_counter = max_block_count-1;
-        int current_block_pos = inode_data_list[current_block_counter].block_pos;
-        int current_block_filled = inode_data_list[current_block_counter].block_filled;
-        fseek(fp, (current_block_pos-1)*BLOCK_SIZE+current_block_filled, 0);
-        for(int j=0;j<buffer_size;++j){
-          // Check if current block is filled
-          if(current_block_filled == BLOCK_SIZE){
-            // If next block exists, move to next block
-            if(current_block_counter < max_block_count-1){
-              // Update current block
-              ++current_block_counter;
-              current_block_pos = inode_data_list[current_block_counter].block_pos;
-              current_block_filled = inode_data_list[current_block_counter].block_filled;
-              fseek(fp, (current_block_pos-1)*BLOCK_SIZE, 0);
-            }else{
-              // Add new block
-              int res = get_empty_block();
-              if(res < 0){
-                break;
-              }else{
-                struct inode_data temp;
-                temp.block_pos = res;
-                temp.block_filled = 0;
-                inode_data_list.push_back(temp);
-                // Update current block
-                max_block_count = inode_data_list.size();
-                ++current_block_counter;
-                current_block_pos = inode_data_list[current_block_counter].block_pos;
-                current_block_filled = inode_data_list[current_block_counter].block_filled;
-                fseek(fp, (current_block_pos-1)*BLOCK_SIZE, 0);
-              }
-            }
-          }
-          fwrite(&buffer[j], sizeof(buffer[j]), 1, fp);
-          ++inode_data_list[current_block_counter].block_filled;
+  int append_to_file(int fd, char* buffer, int buffer_size){
+    OpTimer timer(stats, OP_APPEND);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_APPEND, fd, buffer_size, NULL, (trace_fp != NULL && is_zero_range(buffer, max(buffer_size, 0))) ? TRACE_ZERO_DATA : 0);
+    int slot = get_open_slot(fd);
+    if(slot < 0){
+      return 0;
+    }
+    struct inode_cache_entry& entry = inode_cache[slot];
+    struct inode_data* map = cache_map(slot);
+    int tail = entry.block_count-1;
+    // Blocks from the tail on may be rewritten; positions are read only after room is made
+    begin_update(min(Geometry::max_inode_blocks-tail, (map[tail].block_filled+buffer_size+Geometry::block_size-1)/Geometry::block_size));
+    int j = tail;
+    int write_count = 0;
+    while(write_count < buffer_size){
+      if(map[j].block_filled == Geometry::block_size){
+        // Add new entry, as a hole until data needs a block
+        if(j+1 == Geometry::max_inode_blocks){
+          break;
         }
-
-        // Update inode data
-        fseek(fp, (inode_pos-1)*BLOCK_SIZE, 0);
-        ++current_block_counter;
-        fwrite(&current_block_counter, sizeof(current_block_counter), 1, fp);
-        for(int j=0;j<current_block_counter;++j){
-          fwrite(&inode_data_list[j], sizeof(inode_data_list[j]), 1, fp);
+        ++j;
+        map[j].block_pos = 0;
+        map[j].block_filled = 0;
+      }
+      int chunk = min(Geometry::block_size-map[j].block_filled, buffer_size-write_count);
+      if(map[j].block_pos == 0){
+        if(is_zero_range(&buffer[write_count], chunk)){
+          map[j].block_filled += chunk;
+          write_count += chunk;
+          stats.add(IO_ZERO_BLOCKS_SKIPPED, 1);
+          continue;
         }
-        break;
+        int res = alloc_block(entry.inode_pos, last_block(map, j));
+        if(res < 0){
+          break;
+        }
+        map[j].block_pos = res;
+        // Zeroes held by the hole so far
+        if(map[j].block_filled > 0){
+          static const char zero_block[Geometry::block_size] = {0};
+          disk_seek(Geometry::offset(map[j].block_pos));
+          disk_write(zero_block, 1, map[j].block_filled);
+        }
+      }else if(layout == LAYOUT_LOG){
+        // Copy partly filled tail to log head rather than writing it in place
+        int res = copy_block(map[j].block_pos, map[j].block_filled, entry.inode_pos, 0);
+        if(res < 0){
+          break;
+        }
+        map[j].block_pos = res;
+      }
+      disk_seek(Geometry::offset(map[j].block_pos)+map[j].block_filled);
+      disk_write(&buffer[write_count], 1, chunk);
+      map[j].block_filled += chunk;
+      write_count += chunk;
+    }
+    // Leave inode as it was if nothing could be appended
+    if(write_count == 0){
+      end_update();
+      return 0;
+    }
+    // Drop an entry added just before memory ran out
+    if(j > tail && map[j].block_filled == 0){
+      --j;
+    }
+    entry.block_count = j+1;
+    entry.file_size += write_count;
+    write_inode(slot, tail);
+    end_update();
+    return write_count;
+  }
+
+  /*
+   * Function to find where data starts at or after given offset, like lseek with SEEK_DATA.
+   * Parameters:
+   * fd -- int
+   * offset -- int
+   *
+   * Retval:
+   * -1 -- No data at or after offset, or no file open with given file descriptor
+   * Non negative integer -- Offset of data
+   */
+  int seek_data(int fd, int offset){
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(TRACE_SEEK_DATA, fd, offset, NULL);
+    int slot = get_open_slot(fd);
+    if(slot < 0 || offset < 0){
+      return -1;
+    }
+    struct inode_data* map = cache_map(slot);
+    int start = 0;
+    for(int j=0;j<inode_cache[slot].block_count;++j){
+      int end = start+map[j].block_filled;
+      if(end > offset && map[j].block_pos != 0){
+        return max(start, offset);
+      }
+      start = end;
+    }
+    return -1;
+  }
+
+  /*
+   * Function to find where a hole starts at or after given offset, like lseek with SEEK_HOLE.
+   * End of file counts as a hole.
+   * Parameters:
+   * fd -- int
+   * offset -- int
+   *
+   * Retval:
+   * -1 -- Offset is past end of file, or no file open with given file descriptor
+   * Non negative integer -- Offset of hole
+   */
+  int seek_hole(int fd, int offset){
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(TRACE_SEEK_HOLE, fd, offset, NULL);
+    int slot = get_open_slot(fd);
+    if(slot < 0 || offset < 0 || offset >= inode_cache[slot].file_size){
+      return -1;
+    }
+    struct inode_data* map = cache_map(slot);
+    int start = 0;
+    for(int j=0;j<inode_cache[slot].block_count;++j){
+      int end = start+map[j].block_filled;
+      if(end > offset && map[j].block_pos == 0){
+        return max(start, offset);
       }
+      start = end;
     }
+    return inode_cache[slot].file_size;
   }
 
   /*
@@ -606,14 +3155,205 @@ public:
    * fd -- int
    */
   int close_file(int fd){
+    OpTimer timer(stats, OP_CLOSE);
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(OP_CLOSE, fd, 0, NULL);
     int flag = 0;
     for(int i=0;i<open_file_list.size();++i){
       if(open_file_list[i].fd == fd){
+        --inode_cache[open_file_list[i].cache_slot].pin_count;
         open_file_list.erase(open_file_list.begin()+i);
         flag = 1;
         break;
       }
     }
+    sync_for_mode(DURABILITY_ON_CLOSE);
     return flag;
   }
+
+  /*
+   * Function to make all data written to disk so far durable, including given file's blocks and inode.
+   * Parameters:
+   * fd -- int
+   *
+   * Retval:
+   * -2 -- Sync failed
+   * -1 -- No file open with given file descriptor
+   * 0 -- File synced
+   */
+  int fsync(int fd){
+    lock_guard<recursive_mutex> guard(fs_lock);
+    trace_call(TRACE_FSYNC, fd, 0, NULL);
+    if(get_open_slot(fd) < 0){
+      return -1;
+    }
+    return sync_dirty() < 0 ? -2 : 0;
+  }
+
+  /*
+   * Function to get lock which threads sharing this file system hold around calls.
+   */
+  recursive_mutex& io_lock(){
+    return fs_lock;
+  }
+
+  /*
+   * Function to get a snapshot of operation counters, latency percentiles and I/O counters.
+   *
+   * Retval:
+   * fs_stats struct holding the snapshot
+   */
+  struct fs_stats get_stats(){
+    return stats.snapshot();
+  }
+
+  void display_stats(){
+    const char* op_names[OP_COUNT] = {"create", "open", "read", "write", "append", "close", "delete", "search", "export", "import"};
+    const char* io_names[IO_COUNT] = {"seek calls", "read calls", "write calls", "bytes read", "bytes written",
+      "inode scans", "inode scan length", "block scans", "block scan length", "zero blocks skipped", "sync calls",
+      "checkpoints", "segments cleaned", "kernel copy bytes"};
+    struct fs_stats res = get_stats();
+    for(int i=0;i<OP_COUNT;++i){
+      cout<<op_names[i]<<" count: "<<res.ops[i].count<<" p50: "<<res.ops[i].p50_ns<<"ns p99: "<<res.ops[i].p99_ns<<"ns p999: "<<res.ops[i].p999_ns<<"ns"<<endl;
+    }
+    for(int i=0;i<IO_COUNT;++i){
+      cout<<io_names[i]<<": "<<res.io[i]<<endl;
+    }
+  }
+};
+
+typedef BasicFileSystem<default_geometry, stdio_storage> FileSystem;
+typedef BasicFileSystem<default_geometry, ram_storage> RamFileSystem;
+
+/*
+ * Class to append to an open file from many producer threads without waiting for disk.
+ * Producers copy into the active buffer and return. A writer thread swaps the two buffers
+ * and appends the full one with a single append_to_file, so the inode is updated once per flush.
+ * A flush happens when flush_size bytes are buffered (only whole blocks are written then),
+ * when flush_interval_ms passes, or when flush() is called.
+ * Every public file system call takes the file system's lock itself, so other threads may use the
+ * file system at the same time without holding io_lock(). The writer holds it only so the tail size it
+ * reads stays valid for its append.
+ */
+template <class FS>
+class AppendStream {
+private:
+  FS& fs;
+  int fd;
+  int flush_size;
+  int flush_interval_ms;
+  vector<char> buffers[2];
+  int active;
+  long long accepted;
+  long long written;
+  long long flush_target;
+  int failed;
+  int stopping;
+  mutex lock;
+  condition_variable writer_wake;
+  condition_variable producer_wake;
+  thread writer;
+
+  void run_writer(){
+    unique_lock<mutex> guard(lock);
+    while(1){
+      writer_wake.wait_for(guard, chrono::milliseconds(flush_interval_ms), [this]{
+        return stopping || flush_target > written || (int)buffers[active].size() >= flush_size;
+      });
+      if(buffers[active].empty()){
+        if(stopping){
+          break;
+        }
+        continue;
+      }
+      // Only whole blocks are written when flushing because buffer filled up
+      int whole = (flush_target <= written && !stopping && (int)buffers[active].size() >= flush_size);
+      vector<char>& full = buffers[active];
+      active = 1-active;
+      guard.unlock();
+
+      int size = full.size();
+      int res;
+      {
+        lock_guard<recursive_mutex> fs_guard(fs.io_lock());
+        if(whole){
+          int tail = fs.get_file_size(fd)%FS::block_size;
+          size = ((tail+size)/FS::block_size)*FS::block_size-tail;
+          if(size <= 0){
+            size = full.size();
+          }
+        }
+        res = fs.append_to_file(fd, full.data(), size);
+      }
+
+      guard.lock();
+      if(res < size){
+        failed = 1;
+      }
+      written += size;
+      if(size < (int)full.size()){
+        // Put back the partial block ahead of data which came in meanwhile
+        buffers[active].insert(buffers[active].begin(), full.begin()+size, full.end());
+      }
+      full.clear();
+      producer_wake.notify_all();
+    }
+  }
+public:
+  AppendStream(FS& fs, int fd, int flush_size = 64*1024, int flush_interval_ms = 10)
+    : fs(fs), fd(fd), flush_size(flush_size), flush_interval_ms(flush_interval_ms) {
+    active = 0;
+    accepted = 0;
+    written = 0;
+    flush_target = 0;
+    failed = 0;
+    stopping = 0;
+    buffers[0].reserve(2*flush_size);
+    buffers[1].reserve(2*flush_size);
+    writer = thread(&AppendStream::run_writer, this);
+  }
+
+  ~AppendStream(){
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = 1;
+    }
+    writer_wake.notify_one();
+    writer.join();
+  }
+
+  /*
+   * Function to queue data to be appended.
+   * Blocks only while the active buffer holds more than 4*flush_size bytes.
+   * Parameters:
+   * buffer -- char array
+   * buffer_size -- int
+   */
+  void append(const char* buffer, int buffer_size){
+    unique_lock<mutex> guard(lock);
+    producer_wake.wait(guard, [this]{ return (int)buffers[active].size() < 4*flush_size; });
+    buffers[active].insert(buffers[active].end(), buffer, buffer+buffer_size);
+    accepted += buffer_size;
+    if((int)buffers[active].size() >= flush_size){
+      writer_wake.notify_one();
+    }
+  }
+
+  /*
+   * Function to wait until all data queued before the call is appended to the file.
+   *
+   * Retval:
+   * -1 -- Some data could not be appended (out of memory)
+   * 0 -- All data appended
+   */
+  int flush(){
+    unique_lock<mutex> guard(lock);
+    long long target = accepted;
+    flush_target = max(flush_target, target);
+    writer_wake.notify_one();
+    producer_wake.wait(guard, [this, target]{ return written >= target; });
+    return failed ? -1 : 0;
+  }
 };
+
+#endif
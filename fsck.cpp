@@ -0,0 +1,65 @@
+/****
+  * File containing offline checker tool for disk images.
+  * Maps the image and runs the checks in checker.cpp, and optionally repairs the image.
+  *
+  */
+
+// Dependencies
+#include <iostream>
+// Local Dependencies
+#include "checker.cpp"
+
+// Set namespace
+using namespace std;
+
+int main(int argc, char** argv){
+  if(argc < 2){
+    cout<<"Usage: "<<argv[0]<<" <disk> [--repair] [threads]\n";
+    return FSCK_ERROR;
+  }
+  struct check_state state;
+  int do_repair = 0;
+  state.thread_count = thread::hardware_concurrency();
+  for(int i=2;i<argc;++i){
+    if(strcmp(argv[i], "--repair") == 0){
+      do_repair = 1;
+    }else{
+      state.thread_count = atoi(argv[i]);
+    }
+  }
+  if(state.thread_count < 1){
+    state.thread_count = 1;
+  }
+
+  // Map whole image
+  int fd = open(argv[1], do_repair ? O_RDWR : O_RDONLY);
+  struct stat info;
+  if(fd < 0 || fstat(fd, &info) < 0 || info.st_size < Geometry::offset(Geometry::block_end+1)){
+    cout<<"Failed to open disk, or disk is smaller than "<<Geometry::offset(Geometry::block_end+1)<<" bytes\n";
+    return FSCK_ERROR;
+  }
+  state.image = (char*)mmap(NULL, info.st_size, do_repair ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(state.image == MAP_FAILED){
+    cout<<"Failed to map disk\n";
+    return FSCK_ERROR;
+  }
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  int res = check_image(state, do_repair);
+  cout<<"layout: "<<(state.layout == LAYOUT_LOG ? "log" : "block")<<" files: "<<state.files.size()<<" threads: "<<state.thread_count<<endl;
+  cout<<"bad names: "<<state.bad_names<<"\nshared inodes: "<<state.shared_inodes<<"\nbad inodes: "<<state.bad_inodes<<endl;
+  cout<<"bad entries: "<<state.bad_entries<<"\ndoubly allocated blocks: "<<state.double_blocks<<endl;
+  cout<<"orphan inodes: "<<state.orphan_inodes<<"\nleaked blocks: "<<state.leaked_blocks<<endl;
+  cout<<"blocks used: "<<state.used_blocks<<" free: "<<(int)state.block_claims.size()-state.used_blocks<<endl;
+  if(state.zero_headed_blocks > 0){
+    cout<<"note: "<<state.zero_headed_blocks<<" used blocks start with four zero bytes and look free to a first int scan\n";
+  }
+  if(res == FSCK_CORRECTED){
+    msync(state.image, info.st_size, MS_SYNC);
+    cout<<"Repaired\n";
+  }
+  cout<<"checked in "<<chrono::duration<double>(chrono::steady_clock::now()-start).count()<<"s\n";
+  munmap(state.image, info.st_size);
+  return res;
+}
@@ -0,0 +1,156 @@
+/****
+  * File containing load generator for file system server.
+  * Forks client processes which each pipeline appends to their own file and report latency.
+  *
+  */
+
+// Dependencies
+#include <iostream>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <algorithm>
+// Local Dependencies
+#include "client.cpp"
+
+// Set namespace
+using namespace std;
+
+#define FILE_LIMIT 1024*1024
+
+struct load_result {
+  long long ops;
+  double elapsed;
+  long long p50_ns;
+  long long p99_ns;
+  int errors;
+  // Payloads sent inline because shared memory was full
+  long long shm_fallbacks;
+};
+
+/*
+ * Function to run load from one client process.
+ */
+struct load_result run_client(const char* socket_path, int ops, int size, int depth, int use_shm){
+  struct load_result result;
+  memset(&result, 0, sizeof(result));
+  FsClient client;
+  if(client.connect_server(socket_path) < 0){
+    result.errors = 1;
+    return result;
+  }
+  if(use_shm){
+    client.attach_shm((long long)size*depth);
+  }
+  char file_name[FILE_NAME_SIZE];
+  snprintf(file_name, sizeof(file_name), "load_%d", getpid());
+  client.add_file_to_disk(file_name);
+  int write_fd = client.open_file(file_name, 2);
+  int append_fd = client.open_file(file_name, 3);
+  vector<char> buffer(size, 'x');
+
+  vector<long long> latency;
+  vector<pair<unsigned int, chrono::steady_clock::time_point> > in_flight;
+  long long file_size = 0;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for(int i=0;i<ops||!in_flight.empty();){
+    if(i < ops && (int)in_flight.size() < depth){
+      // Keep file under inode capacity by rewriting it once it grows large
+      int op = REQ_APPEND;
+      int fd = append_fd;
+      if(file_size+size > FILE_LIMIT){
+        op = REQ_WRITE;
+        fd = write_fd;
+        file_size = 0;
+      }
+      file_size += size;
+      in_flight.push_back(make_pair(client.submit(op, fd, 0, NULL, buffer.data(), size), chrono::steady_clock::now()));
+      ++i;
+      continue;
+    }
+    struct client_response res;
+    if(client.wait(in_flight[0].first, res) < 0){
+      result.errors += in_flight.size()+ops-i;
+      break;
+    }
+    if(res.status != size){
+      ++result.errors;
+    }
+    latency.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-in_flight[0].second).count());
+    in_flight.erase(in_flight.begin());
+  }
+  result.elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+  result.ops = latency.size();
+  if(!latency.empty()){
+    sort(latency.begin(), latency.end());
+    result.p50_ns = latency[latency.size()/2];
+    result.p99_ns = latency[min(latency.size()-1, latency.size()*99/100)];
+  }
+  result.shm_fallbacks = client.get_shm_fallbacks();
+  client.close_file(write_fd);
+  client.close_file(append_fd);
+  client.remove_file_from_disk(file_name);
+  return result;
+}
+
+int main(int argc, char** argv){
+  if(argc < 2){
+    cout<<"Usage: "<<argv[0]<<" <socket> [clients] [ops per client] [bytes per op] [pipeline depth] [--shm]\n";
+    return 1;
+  }
+  const char* socket_path = argv[1];
+  int clients = (argc > 2) ? atoi(argv[2]) : 4;
+  int ops = (argc > 3) ? atoi(argv[3]) : 10000;
+  int size = (argc > 4) ? atoi(argv[4]) : 128;
+  int depth = (argc > 5) ? atoi(argv[5]) : 16;
+  int use_shm = (argc > 6) && strcmp(argv[6], "--shm") == 0;
+  if(depth < 1){
+    depth = 1;
+  }
+
+  vector<int> pipes;
+  for(int c=0;c<clients;++c){
+    int fds[2];
+    pipe(fds);
+    if(fork() == 0){
+      close(fds[0]);
+      struct load_result result = run_client(socket_path, ops, size, depth, use_shm);
+      write(fds[1], &result, sizeof(result));
+      _exit(0);
+    }
+    close(fds[1]);
+    pipes.push_back(fds[0]);
+  }
+
+  long long total_ops = 0;
+  double max_elapsed = 0;
+  long long max_p50 = 0;
+  long long max_p99 = 0;
+  int errors = 0;
+  long long shm_fallbacks = 0;
+  for(int c=0;c<clients;++c){
+    struct load_result result;
+    if(read(pipes[c], &result, sizeof(result)) != sizeof(result)){
+      ++errors;
+      continue;
+    }
+    close(pipes[c]);
+    total_ops += result.ops;
+    max_elapsed = max(max_elapsed, result.elapsed);
+    max_p50 = max(max_p50, result.p50_ns);
+    max_p99 = max(max_p99, result.p99_ns);
+    errors += result.errors;
+    shm_fallbacks += result.shm_fallbacks;
+  }
+  while(wait(NULL) > 0);
+
+  cout<<"clients: "<<clients<<" ops: "<<total_ops<<" errors: "<<errors<<endl;
+  if(max_elapsed > 0){
+    cout<<"throughput: "<<total_ops/max_elapsed<<" ops/s "<<total_ops*(double)size/max_elapsed/(1024*1024)<<" MiB/s"<<endl;
+  }
+  cout<<"latency p50: "<<max_p50<<"ns p99: "<<max_p99<<"ns (worst client)"<<endl;
+  if(use_shm){
+    cout<<"shm fallbacks: "<<shm_fallbacks<<" of "<<total_ops<<" ops sent inline"<<endl;
+  }
+  return errors ? 1 : 0;
+}
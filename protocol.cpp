@@ -0,0 +1,63 @@
+/****
+  * File containing message formats shared by file system server and clients.
+  *
+  * Every request is a request_header followed by name_len bytes of file name and, unless
+  * FLAG_SHM is set, length bytes of payload. Every response is a response_header followed,
+  * for reads without FLAG_SHM, by length bytes of data. Requests are pipelined: a client may
+  * send many requests before reading responses, and responses carry the req_id they answer.
+  *
+  * Shared memory is created by the server: the response to REQ_ATTACH_SHM carries a sealed
+  * memfd as SCM_RIGHTS ancillary data on its first byte, so clients cannot shrink it under the server.
+  */
+
+#ifndef PROTOCOL_CPP
+#define PROTOCOL_CPP
+
+#define MAX_REQUEST_DATA 16*1024*1024
+#define MAX_SHM_SIZE 256*1024*1024
+
+// Request types, used by server and clients alike
+enum request_op {
+  REQ_CREATE,
+  REQ_OPEN,
+  REQ_READ,
+  REQ_WRITE,
+  REQ_APPEND,
+  REQ_CLOSE,
+  REQ_DELETE,
+  REQ_ATTACH_SHM = 100,
+  REQ_FILE_SIZE = 101
+};
+
+// Request flags
+#define FLAG_SHM 1
+
+/*
+ * fd -- File descriptor for read, write, append, close and size
+ * arg -- Mode for open, or size of shared memory for REQ_ATTACH_SHM
+ * length -- Bytes to write or append, or bytes wanted for read
+ * shm_offset -- Offset of payload in shared memory when FLAG_SHM is set
+ */
+struct __attribute__((packed)) request_header {
+  unsigned int req_id;
+  unsigned char op;
+  unsigned char flags;
+  unsigned short name_len;
+  int fd;
+  int arg;
+  int length;
+  long long shm_offset;
+};
+
+/*
+ * status -- Return value of the file system call
+ *   -3 -- Malformed request, or file descriptor not opened by this client
+ * length -- Bytes of data that follow, or were placed in shared memory
+ */
+struct __attribute__((packed)) response_header {
+  unsigned int req_id;
+  int status;
+  int length;
+};
+
+#endif
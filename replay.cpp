@@ -0,0 +1,243 @@
+/****
+  * File containing code to replay a recorded trace against a disk.
+  *
+  */
+
+// Dependencies
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <thread>
+// Local Dependencies
+#include "filesystem.cpp"
+
+// Set namespace
+using namespace std;
+
+/*
+ * Function to copy a disk image, skipping chunks of zeroes so copy stays sparse.
+ *
+ * Params:
+ * src -- string
+ * dst -- string
+ *
+ * Retval:
+ * -1 -- Failed to copy image
+ * 0 -- Image copied
+ */
+int copy_image(char* src, char* dst){
+  int in = open(src, O_RDONLY);
+  if(in < 0){
+    return -1;
+  }
+  int out = open(dst, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+  if(out < 0){
+    close(in);
+    return -1;
+  }
+  vector<char> chunk(1024*1024);
+  off_t offset = 0;
+  while(1){
+    ssize_t res = read(in, chunk.data(), chunk.size());
+    if(res <= 0){
+      break;
+    }
+    int zero = 1;
+    for(ssize_t i=0;i<res;++i){
+      if(chunk[i] != 0){
+        zero = 0;
+        break;
+      }
+    }
+    if(!zero){
+      pwrite(out, chunk.data(), res, offset);
+    }
+    offset += res;
+  }
+  ftruncate(out, offset);
+  close(in);
+  close(out);
+  return 0;
+}
+
+int main(int argc, char** argv){
+  if(argc < 3){
+    cout<<"Usage: "<<argv[0]<<" <trace> <disk> [--fresh] [--snapshot <image>] [--timed]\n";
+    return 1;
+  }
+  char* trace_name = argv[1];
+  char* disk_name = argv[2];
+  int fresh = 0;
+  int timed = 0;
+  char* snapshot = NULL;
+  for(int i=3;i<argc;++i){
+    if(strcmp(argv[i], "--fresh") == 0){
+      fresh = 1;
+    }else if(strcmp(argv[i], "--timed") == 0){
+      timed = 1;
+    }else if(strcmp(argv[i], "--snapshot") == 0 && i+1 < argc){
+      snapshot = argv[++i];
+    }else{
+      cout<<"Not recognised: "<<argv[i]<<endl;
+      return 1;
+    }
+  }
+
+  FILE* trace_fp = fopen(trace_name, "rb");
+  if(trace_fp == NULL){
+    cout<<"Failed to open trace\n";
+    return 1;
+  }
+  struct trace_header header;
+  if(fread(&header, sizeof(header), 1, trace_fp) != 1 || header.magic != TRACE_MAGIC){
+    cout<<"Not a trace file\n";
+    return 1;
+  }
+
+  // Prepare disk; a fresh disk gets the layout of the traced disk, and every replay mounts with its durability
+  FileSystem fs;
+  int disk_layout = LAYOUT_BLOCK;
+  if(snapshot != NULL){
+    if(copy_image(snapshot, disk_name) < 0){
+      cout<<"Failed to copy snapshot\n";
+      return 1;
+    }
+  }else if(fresh){
+    unlink(disk_name);
+    disk_layout = header.layout;
+  }
+  if(fs.create_disk(disk_name, disk_layout) < 0 || fs.mount_disk(disk_name, header.durability) < 0){
+    cout<<"Failed to mount disk\n";
+    return 1;
+  }
+
+  // Discard output of display calls
+  ofstream null_stream;
+  streambuf* cout_buf = cout.rdbuf(null_stream.rdbuf());
+
+  // Exports go to /dev/null and imports come from a scratch file holding the recorded number of bytes
+  // Data of writes, appends and imports is filler, or zeroes when traced as all zeroes
+  int null_fd = open("/dev/null", O_WRONLY);
+  FILE* import_fp = tmpfile();
+  map<int, int> fd_map;
+  vector<char> buffer;
+  // Data of calls traced as all zeroes
+  vector<char> zeroes;
+  long long op_count = 0;
+  long long bytes = 0;
+  struct trace_record rec;
+  // Large enough for search patterns as well as file names
+  char file_name[UCHAR_MAX+1];
+  vector<string> batch_names;
+  vector<char*> batch_ptrs;
+  vector<int> batch_results;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  while(fread(&rec, sizeof(rec), 1, trace_fp) == 1){
+    fread(file_name, 1, rec.name_len, trace_fp);
+    file_name[rec.name_len] = '\0';
+    int batch = rec.op == TRACE_CREATE_BATCH || rec.op == TRACE_DELETE_BATCH;
+    if(batch){
+      batch_names.assign(max(rec.arg, 0), string());
+      for(int i=0;i<batch_names.size();++i){
+        unsigned char name_len = 0;
+        fread(&name_len, 1, 1, trace_fp);
+        batch_names[i].resize(name_len);
+        fread(&batch_names[i][0], 1, name_len, trace_fp);
+      }
+    }
+    if(timed){
+      this_thread::sleep_until(start+chrono::nanoseconds(rec.timestamp_ns));
+    }
+    // Map recorded descriptor to descriptor in this run
+    int fd = -1;
+    if(rec.op != OP_CREATE && rec.op != OP_DELETE && rec.op != OP_OPEN && rec.op != OP_SEARCH && rec.op != OP_IMPORT && !batch){
+      if(fd_map.find(rec.fd) == fd_map.end()){
+        continue;
+      }
+      fd = fd_map[rec.fd];
+    }
+    int sized = rec.op == OP_READ || rec.op == OP_WRITE || rec.op == OP_APPEND || rec.op == OP_IMPORT;
+    if(sized && rec.arg > 0 && (int)buffer.size() < rec.arg){
+      buffer.resize(rec.arg, 'x');
+    }
+    int zero = rec.flags&TRACE_ZERO_DATA;
+    if(zero && rec.arg > 0 && (int)zeroes.size() < rec.arg){
+      zeroes.resize(rec.arg, 0);
+    }
+    char* data = zero ? zeroes.data() : buffer.data();
+    if(rec.op == OP_CREATE){
+      fs.add_file_to_disk(file_name);
+    }else if(rec.op == OP_DELETE){
+      fs.remove_file_from_disk(file_name);
+    }else if(rec.op == OP_OPEN){
+      int res = fs.open_file(file_name, rec.arg);
+      if(rec.fd >= 0 && res >= 0){
+        fd_map[rec.fd] = res;
+      }
+    }else if(rec.op == OP_CLOSE){
+      fs.close_file(fd);
+      fd_map.erase(rec.fd);
+    }else if(rec.op == OP_READ){
+      // Whole file reads (arg -1) are replayed through display
+      if(rec.arg >= 0){
+        fs.read_from_file(fd, buffer.data(), rec.arg);
+      }else{
+        fs.display_file(fd);
+      }
+    }else if(rec.op == OP_WRITE){
+      fs.write_to_file(fd, data, rec.arg);
+      bytes += rec.arg;
+    }else if(rec.op == OP_APPEND){
+      fs.append_to_file(fd, data, rec.arg);
+      bytes += rec.arg;
+    }else if(rec.op == OP_SEARCH){
+      struct search_options options = {rec.arg, rec.fd};
+      fs.search(file_name, options);
+    }else if(rec.op == OP_EXPORT){
+      fs.export_file(fd, null_fd);
+    }else if(rec.op == OP_IMPORT){
+      // Zero input is left as a hole, as sparse input of the traced import was
+      ftruncate(fileno(import_fp), 0);
+      if(zero){
+        ftruncate(fileno(import_fp), max(rec.arg, 0));
+      }else{
+        pwrite(fileno(import_fp), buffer.data(), max(rec.arg, 0), 0);
+      }
+      lseek(fileno(import_fp), 0, SEEK_SET);
+      fs.import_file(fileno(import_fp), file_name);
+      bytes += max(rec.arg, 0);
+    }else if(batch){
+      batch_ptrs.resize(batch_names.size());
+      batch_results.resize(batch_names.size());
+      for(int i=0;i<batch_names.size();++i){
+        batch_ptrs[i] = &batch_names[i][0];
+      }
+      if(rec.op == TRACE_CREATE_BATCH){
+        fs.add_files_to_disk(batch_ptrs.data(), batch_ptrs.size(), batch_results.data());
+      }else{
+        fs.remove_files_from_disk(batch_ptrs.data(), batch_ptrs.size(), batch_results.data());
+      }
+    }else if(rec.op == TRACE_FSYNC){
+      fs.fsync(fd);
+    }else if(rec.op == TRACE_SEEK_DATA){
+      fs.seek_data(fd, rec.arg);
+    }else if(rec.op == TRACE_SEEK_HOLE){
+      fs.seek_hole(fd, rec.arg);
+    }
+    ++op_count;
+  }
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+  cout.rdbuf(cout_buf);
+  fclose(trace_fp);
+  fclose(import_fp);
+  close(null_fd);
+
+  // Report
+  cout<<"ops: "<<op_count<<" elapsed: "<<elapsed<<"s"<<endl;
+  if(elapsed > 0){
+    cout<<"throughput: "<<op_count/elapsed<<" ops/s "<<bytes/elapsed/(1024*1024)<<" MiB/s written"<<endl;
+  }
+  fs.display_stats();
+  fs.unmount_disk();
+  return 0;
+}
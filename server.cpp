@@ -0,0 +1,55 @@
+/****
+  * File containing code to serve a mounted disk to many local clients over a Unix socket.
+  *
+  */
+
+// Dependencies
+#include <iostream>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+// Local Dependencies
+#include "service.cpp"
+
+// Set namespace
+using namespace std;
+
+void handle_signal(int sig){
+  running = 0;
+}
+
+int main(int argc, char** argv){
+  if(argc < 3){
+    cout<<"Usage: "<<argv[0]<<" <disk> <socket>\n";
+    return 1;
+  }
+  char* disk_name = argv[1];
+  char* socket_path = argv[2];
+  if(fs.create_disk(disk_name) < 0 || fs.mount_disk(disk_name) < 0){
+    cout<<"Failed to mount disk\n";
+    return 1;
+  }
+
+  int listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+  unlink(socket_path);
+  if(bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_sock, 128) < 0){
+    cout<<"Failed to listen on socket\n";
+    return 1;
+  }
+  fcntl(listen_sock, F_SETFL, O_NONBLOCK);
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGPIPE, SIG_IGN);
+  cout<<"Serving "<<disk_name<<" on "<<socket_path<<endl;
+
+  serve(listen_sock);
+  close(listen_sock);
+  unlink(socket_path);
+  fs.unmount_disk();
+  cout<<"Server stopped\n";
+  return 0;
+}
@@ -0,0 +1,423 @@
+/****
+  * File containing request handling for file system server.
+  * Reads pipelined requests from all clients, runs them in batches against one mounted disk and queues responses.
+  *
+  */
+
+#ifndef SERVICE_CPP
+#define SERVICE_CPP
+
+// Dependencies
+#include <iostream>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <set>
+// Local Dependencies
+#include "filesystem.cpp"
+#include "protocol.cpp"
+
+// Set namespace
+using namespace std;
+
+#define MAX_CLIENTS 1024
+#define RECV_CHUNK 64*1024
+// Bytes of unparsed requests, or unsent responses, held for one client before it stops being read
+#define MAX_CLIENT_BUFFER 32*1024*1024
+
+struct client_info {
+  int sock;
+  vector<char> in;
+  vector<char> out;
+  size_t out_sent;
+  char* shm;
+  long long shm_size;
+  // Shared memory fd to pass with the response starting at shm_fd_at in out, -1 if none
+  int shm_fd;
+  size_t shm_fd_at;
+  set<int> fds;
+};
+
+// A parsed request waiting in the current batch
+struct pending_request {
+  int client;
+  struct request_header header;
+  char file_name[FILE_NAME_SIZE];
+  char* payload;
+};
+
+FileSystem fs;
+vector<struct client_info> clients;
+volatile sig_atomic_t running = 1;
+
+void add_response(struct client_info& client, unsigned int req_id, int status, const char* data, int length){
+  struct response_header res;
+  res.req_id = req_id;
+  res.status = status;
+  res.length = length;
+  client.out.insert(client.out.end(), (char*)&res, (char*)&res+sizeof(res));
+  if(data != NULL){
+    client.out.insert(client.out.end(), data, data+length);
+  }
+}
+
+void drop_client(int index){
+  struct client_info& client = clients[index];
+  for(set<int>::iterator it=client.fds.begin();it!=client.fds.end();++it){
+    fs.close_file(*it);
+  }
+  if(client.shm != NULL){
+    munmap(client.shm, client.shm_size);
+  }
+  if(client.shm_fd >= 0){
+    close(client.shm_fd);
+  }
+  close(client.sock);
+  clients.erase(clients.begin()+index);
+}
+
+/*
+ * Function to send pending output of client, passing shared memory fd with the response it belongs to.
+ *
+ * Retval:
+ * -1 -- Send failed, or would block
+ * Number of bytes sent
+ */
+ssize_t send_output(struct client_info& client){
+  size_t end = client.out.size();
+  if(client.shm_fd >= 0 && client.shm_fd_at > client.out_sent){
+    end = client.shm_fd_at;
+  }
+  if(client.shm_fd < 0 || client.shm_fd_at != client.out_sent){
+    return send(client.sock, &client.out[client.out_sent], end-client.out_sent, MSG_NOSIGNAL);
+  }
+  struct iovec iov;
+  iov.iov_base = &client.out[client.out_sent];
+  iov.iov_len = end-client.out_sent;
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client.shm_fd, sizeof(int));
+  ssize_t res = sendmsg(client.sock, &msg, MSG_NOSIGNAL);
+  if(res > 0){
+    close(client.shm_fd);
+    client.shm_fd = -1;
+  }
+  return res;
+}
+
+/*
+ * Function to get pointer to a shared memory range of client.
+ *
+ * Retval:
+ * NULL -- Range is outside shared memory
+ * Pointer to start of range
+ */
+char* shm_range(struct client_info& client, long long offset, int length){
+  if(client.shm == NULL || offset < 0 || length < 0 || offset+length > client.shm_size){
+    return NULL;
+  }
+  return client.shm+offset;
+}
+
+/*
+ * Function to parse complete requests from input buffer of client into batch.
+ * Stops early once responses to parsed requests would take client past MAX_CLIENT_BUFFER.
+ *
+ * Retval:
+ * -1 -- Malformed request, client should be dropped
+ * 0 -- Parsed all complete requests
+ * 1 -- Complete requests left in input buffer
+ */
+int parse_requests(int index, vector<struct pending_request>& batch, vector<size_t>& consumed){
+  struct client_info& client = clients[index];
+  size_t pos = 0;
+  size_t queued = client.out.size()-client.out_sent;
+  int res = 0;
+  while(client.in.size()-pos >= sizeof(struct request_header)){
+    struct pending_request req;
+    memcpy(&req.header, &client.in[pos], sizeof(req.header));
+    if(req.header.name_len >= FILE_NAME_SIZE || req.header.length < 0 || req.header.length > MAX_REQUEST_DATA){
+      return -1;
+    }
+    size_t payload_len = 0;
+    if((req.header.op == REQ_WRITE || req.header.op == REQ_APPEND) && !(req.header.flags & FLAG_SHM)){
+      payload_len = req.header.length;
+    }
+    size_t total = sizeof(req.header)+req.header.name_len+payload_len;
+    if(client.in.size()-pos < total){
+      break;
+    }
+    size_t response_len = sizeof(struct response_header);
+    if(req.header.op == REQ_READ && !(req.header.flags & FLAG_SHM)){
+      response_len += req.header.length;
+    }
+    if(queued > 0 && queued+response_len > MAX_CLIENT_BUFFER){
+      res = 1;
+      break;
+    }
+    queued += response_len;
+    memcpy(req.file_name, &client.in[pos+sizeof(req.header)], req.header.name_len);
+    req.file_name[req.header.name_len] = '\0';
+    req.payload = payload_len ? &client.in[pos+sizeof(req.header)+req.header.name_len] : NULL;
+    req.client = index;
+    batch.push_back(req);
+    pos += total;
+  }
+  consumed[index] = pos;
+  return res;
+}
+
+/*
+ * Function to run a request for which no batching applies.
+ */
+void run_request(struct pending_request& req){
+  struct client_info& client = clients[req.client];
+  struct request_header& h = req.header;
+  int owned = client.fds.count(h.fd);
+  if(h.op == REQ_ATTACH_SHM){
+    char* shm = (char*)MAP_FAILED;
+    int shm_fd = -1;
+    if(h.arg > 0 && h.arg <= MAX_SHM_SIZE && client.shm_fd < 0){
+      shm_fd = memfd_create("naive_fs_shm", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    }
+    // Seal size so client cannot truncate the region while it is mapped here
+    if(shm_fd >= 0 && ftruncate(shm_fd, h.arg) == 0
+      && fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL) == 0){
+      shm = (char*)mmap(NULL, h.arg, PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    }
+    if(shm == MAP_FAILED){
+      if(shm_fd >= 0){
+        close(shm_fd);
+      }
+      add_response(client, h.req_id, -1, NULL, 0);
+      return;
+    }
+    if(client.shm != NULL){
+      munmap(client.shm, client.shm_size);
+    }
+    client.shm = shm;
+    client.shm_size = h.arg;
+    client.shm_fd = shm_fd;
+    client.shm_fd_at = client.out.size();
+    add_response(client, h.req_id, 0, NULL, 0);
+  }else if(h.op == REQ_OPEN){
+    int fd = fs.open_file(req.file_name, h.arg);
+    if(fd >= 0){
+      client.fds.insert(fd);
+    }
+    add_response(client, h.req_id, fd, NULL, 0);
+  }else if(!owned){
+    add_response(client, h.req_id, -3, NULL, 0);
+  }else if(h.op == REQ_CLOSE){
+    client.fds.erase(h.fd);
+    add_response(client, h.req_id, fs.close_file(h.fd), NULL, 0);
+  }else if(h.op == REQ_FILE_SIZE){
+    add_response(client, h.req_id, fs.get_file_size(h.fd), NULL, 0);
+  }else if(h.op == REQ_READ){
+    if(!fs.check_file_mode(h.fd, 1)){
+      add_response(client, h.req_id, -2, NULL, 0);
+    }else if(h.flags & FLAG_SHM){
+      char* data = shm_range(client, h.shm_offset, h.length);
+      int res = data ? fs.read_from_file(h.fd, data, h.length) : -3;
+      add_response(client, h.req_id, res, NULL, 0);
+    }else{
+      // Read straight into output buffer after the header
+      size_t start = client.out.size();
+      add_response(client, h.req_id, 0, NULL, 0);
+      client.out.resize(start+sizeof(struct response_header)+h.length);
+      int res = fs.read_from_file(h.fd, &client.out[start+sizeof(struct response_header)], h.length);
+      client.out.resize(start+sizeof(struct response_header)+res);
+      struct response_header* header = (struct response_header*)&client.out[start];
+      header->status = res;
+      header->length = res;
+    }
+  }else if(h.op == REQ_WRITE || h.op == REQ_APPEND){
+    int mode = (h.op == REQ_WRITE) ? 2 : 3;
+    char* data = (h.flags & FLAG_SHM) ? shm_range(client, h.shm_offset, h.length) : req.payload;
+    if(!fs.check_file_mode(h.fd, mode)){
+      add_response(client, h.req_id, -2, NULL, 0);
+    }else if(data == NULL && h.length > 0){
+      add_response(client, h.req_id, -3, NULL, 0);
+    }else if(h.op == REQ_WRITE){
+      add_response(client, h.req_id, fs.write_to_file(h.fd, data, h.length), NULL, 0);
+    }else{
+      add_response(client, h.req_id, fs.append_to_file(h.fd, data, h.length), NULL, 0);
+    }
+  }else{
+    add_response(client, h.req_id, -3, NULL, 0);
+  }
+}
+
+/*
+ * Function to run a run of create or delete requests from any clients as one batch call.
+ * If the batch fails, requests are retried one at a time so each gets its own result.
+ */
+void run_metadata_batch(vector<struct pending_request>& batch, size_t start, size_t end){
+  int count = end-start;
+  int create = batch[start].header.op == REQ_CREATE;
+  vector<char*> names(count);
+  vector<int> results(count);
+  for(int i=0;i<count;++i){
+    names[i] = batch[start+i].file_name;
+  }
+  int done = create ? fs.add_files_to_disk(names.data(), count, results.data())
+    : fs.remove_files_from_disk(names.data(), count, results.data());
+  if(done < count){
+    for(int i=0;i<count;++i){
+      results[i] = create ? fs.add_file_to_disk(names[i]) : fs.remove_file_from_disk(names[i]);
+    }
+  }
+  for(int i=0;i<count;++i){
+    add_response(clients[batch[start+i].client], batch[start+i].header.req_id, results[i], NULL, 0);
+  }
+}
+
+/*
+ * Function to run all requests received from all clients in one poll round.
+ * Consecutive creates, and consecutive deletes, are merged into one batch call. Reads, writes and appends
+ * still run one call each, in order received; they share only the poll round and the disk's durability mode.
+ */
+void run_batch(vector<struct pending_request>& batch){
+  size_t i = 0;
+  while(i < batch.size()){
+    int op = batch[i].header.op;
+    if(op == REQ_CREATE || op == REQ_DELETE){
+      size_t j = i;
+      while(j < batch.size() && batch[j].header.op == op){
+        ++j;
+      }
+      run_metadata_batch(batch, i, j);
+      i = j;
+    }else{
+      run_request(batch[i]);
+      ++i;
+    }
+  }
+}
+
+/*
+ * Function to serve clients connecting on a listening socket until running is cleared.
+ * All clients are dropped before returning.
+ */
+void serve(int listen_sock){
+  vector<struct pollfd> poll_list;
+  vector<char> chunk(RECV_CHUNK);
+  int backlog = 0;
+  while(running){
+    poll_list.resize(clients.size()+1);
+    poll_list[0].fd = listen_sock;
+    poll_list[0].events = POLLIN;
+    for(size_t i=0;i<clients.size();++i){
+      poll_list[i+1].fd = clients[i].sock;
+      size_t queued = clients[i].out.size()-clients[i].out_sent;
+      poll_list[i+1].events = queued > 0 ? POLLOUT : 0;
+      // Stop reading from clients that send faster than they read responses
+      if(clients[i].in.size() < MAX_CLIENT_BUFFER && queued < MAX_CLIENT_BUFFER){
+        poll_list[i+1].events |= POLLIN;
+      }
+    }
+    // Do not sleep while requests held back for want of buffer space can now run
+    if(poll(poll_list.data(), poll_list.size(), backlog ? 0 : 1000) < 0){
+      continue;
+    }
+
+    // Accept new clients
+    if(poll_list[0].revents & POLLIN){
+      int sock;
+      while((sock = accept(listen_sock, NULL, NULL)) >= 0){
+        if(clients.size() >= MAX_CLIENTS){
+          close(sock);
+          continue;
+        }
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+        struct client_info client;
+        client.sock = sock;
+        client.out_sent = 0;
+        client.shm = NULL;
+        client.shm_size = 0;
+        client.shm_fd = -1;
+        client.shm_fd_at = 0;
+        clients.push_back(client);
+      }
+    }
+
+    // Receive from ready clients and gather requests into one batch
+    size_t polled = poll_list.size()-1;
+    vector<int> dead(clients.size(), 0);
+    for(size_t i=0;i<polled;++i){
+      if(poll_list[i+1].revents & (POLLIN|POLLHUP|POLLERR)){
+        while(clients[i].in.size() < MAX_CLIENT_BUFFER){
+          ssize_t res = recv(clients[i].sock, chunk.data(), chunk.size(), 0);
+          if(res > 0){
+            clients[i].in.insert(clients[i].in.end(), chunk.data(), chunk.data()+res);
+          }else{
+            if(res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+              dead[i] = 1;
+            }
+            break;
+          }
+        }
+      }
+    }
+    vector<struct pending_request> batch;
+    vector<size_t> consumed(clients.size(), 0);
+    vector<int> held(clients.size(), 0);
+    for(size_t i=0;i<clients.size();++i){
+      int res = dead[i] ? 0 : parse_requests(i, batch, consumed);
+      if(res < 0){
+        dead[i] = 1;
+      }else if(res > 0){
+        held[i] = 1;
+      }
+    }
+    run_batch(batch);
+    for(size_t i=0;i<clients.size();++i){
+      clients[i].in.erase(clients[i].in.begin(), clients[i].in.begin()+consumed[i]);
+    }
+
+    // Send responses
+    backlog = 0;
+    for(size_t i=0;i<clients.size();++i){
+      struct client_info& client = clients[i];
+      while(!dead[i] && client.out_sent < client.out.size()){
+        ssize_t res = send_output(client);
+        if(res > 0){
+          client.out_sent += res;
+        }else{
+          if(res < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+            dead[i] = 1;
+          }
+          break;
+        }
+      }
+      if(client.out_sent == client.out.size()){
+        client.out.clear();
+        client.out_sent = 0;
+        backlog |= held[i] && !dead[i];
+      }
+    }
+    for(int i=clients.size()-1;i>=0;--i){
+      if(dead[i]){
+        drop_client(i);
+      }
+    }
+  }
+
+  while(!clients.empty()){
+    drop_client(clients.size()-1);
+  }
+}
+
+#endif
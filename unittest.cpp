@@ -9,10 +9,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
+#include <fstream>
 #include <CUnit/CUnit.h>
 #include <CUnit/Console.h>
 // Local Dependencies
 #include "filesystem.cpp"
+#include "checker.cpp"
+#include "service.cpp"
+#include "client.cpp"
 
 // Set namespace
 using namespace std;
@@ -41,7 +45,7 @@ void test_mount_disk(void){
   // Test mounting disk
   CU_ASSERT(fs.create_disk(file_name) == 1);
   CU_ASSERT(fs.mount_disk(file_name) == 0);
-  CU_ASSERT(fs.unmount_disk(file_name) == 0);
+  CU_ASSERT(fs.unmount_disk() == 0);
   // Delete disk
   system("rm -rf test_disk");
   CU_ASSERT(fs.mount_disk(file_name) == -1);
@@ -169,6 +173,1091 @@ void test_file_append(void){
   system("rm -rf test_disk");
 }
 
+void test_stats(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  char file_name[10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_name, "file1");
+  fs.create_disk(disk_name);
+  fs.mount_disk(disk_name);
+  fs.add_file_to_disk(file_name);
+  int fd = fs.open_file(file_name, 2);
+  char line[10];
+  strcpy(line, "hello");
+  fs.write_to_file(fd, line, 5);
+  fs.close_file(fd);
+  // Test counters
+  struct fs_stats res = fs.get_stats();
+  CU_ASSERT(res.ops[OP_CREATE].count == 1);
+  CU_ASSERT(res.ops[OP_OPEN].count == 1);
+  CU_ASSERT(res.ops[OP_WRITE].count == 1);
+  CU_ASSERT(res.ops[OP_CLOSE].count == 1);
+  CU_ASSERT(res.ops[OP_READ].count == 0);
+  CU_ASSERT(res.ops[OP_WRITE].p50_ns > 0);
+  CU_ASSERT(res.ops[OP_WRITE].p999_ns >= res.ops[OP_WRITE].p50_ns);
+  CU_ASSERT(res.io[IO_BYTES_WRITTEN] >= 5);
+  CU_ASSERT(res.io[IO_INODE_SCANS] == 1);
+  CU_ASSERT(res.io[IO_BLOCK_SCAN_LENGTH] >= 1);
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+}
+
+void test_trace(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  char file_name[10];
+  char trace_name[11];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_name, "file1");
+  strcpy(trace_name, "test_trace");
+  fs.create_disk(disk_name, LAYOUT_LOG);
+  fs.mount_disk(disk_name, DURABILITY_ON_CLOSE);
+  CU_ASSERT(fs.stop_trace() == -1);
+  CU_ASSERT(fs.start_trace(trace_name) == 0);
+  fs.add_file_to_disk(file_name);
+  int fd = fs.open_file(file_name, 3);
+  char line[10];
+  strcpy(line, "hello");
+  fs.append_to_file(fd, line, 5);
+  char zeroes[8] = {0};
+  fs.append_to_file(fd, zeroes, 8);
+  fs.fsync(fd);
+  fs.seek_data(fd, 1);
+  fs.seek_hole(fd, 2);
+  fs.search("ell");
+  int null_fd = open("/dev/null", O_WRONLY);
+  fs.export_file(fd, null_fd);
+  close(null_fd);
+  fs.close_file(fd);
+  int fds[2];
+  pipe(fds);
+  write(fds[1], line, 5);
+  close(fds[1]);
+  fs.import_file(fds[0], (char*)"file2");
+  close(fds[0]);
+  char batch_names[2][10];
+  strcpy(batch_names[0], "file3");
+  strcpy(batch_names[1], "file4");
+  char* batch[2] = {batch_names[0], batch_names[1]};
+  int results[2];
+  fs.add_files_to_disk(batch, 2, results);
+  fs.remove_files_from_disk(batch, 2, results);
+  CU_ASSERT(fs.stop_trace() == 0);
+  // Test records in trace
+  FILE* fp = fopen(trace_name, "rb");
+  struct trace_header header;
+  CU_ASSERT(fread(&header, sizeof(header), 1, fp) == 1);
+  CU_ASSERT(header.magic == TRACE_MAGIC);
+  CU_ASSERT(header.layout == LAYOUT_LOG && header.durability == DURABILITY_ON_CLOSE);
+  struct trace_record rec;
+  int ops[11] = {OP_CREATE, OP_OPEN, OP_APPEND, OP_APPEND, TRACE_FSYNC, TRACE_SEEK_DATA, TRACE_SEEK_HOLE, OP_SEARCH,
+    OP_EXPORT, OP_CLOSE, OP_IMPORT};
+  int args[11] = {0, 3, 5, 8, 0, 1, 2, 0, 0, 0, 5};
+  for(int i=0;i<11;++i){
+    CU_ASSERT(fread(&rec, sizeof(rec), 1, fp) == 1);
+    CU_ASSERT(rec.op == ops[i]);
+    CU_ASSERT(rec.arg == args[i]);
+    // Only the append of zeroes is flagged as zero data
+    CU_ASSERT(rec.flags == ((i == 3) ? TRACE_ZERO_DATA : 0));
+    CU_ASSERT(i == 0 || ops[i] == OP_SEARCH || ops[i] == OP_IMPORT || rec.fd == fd);
+    fseek(fp, rec.name_len, SEEK_CUR);
+  }
+  // Test a batch call is one record followed by its names
+  int batch_ops[2] = {TRACE_CREATE_BATCH, TRACE_DELETE_BATCH};
+  for(int i=0;i<2;++i){
+    CU_ASSERT(fread(&rec, sizeof(rec), 1, fp) == 1);
+    CU_ASSERT(rec.op == batch_ops[i] && rec.arg == 2 && rec.name_len == 0);
+    for(int j=0;j<2;++j){
+      unsigned char name_len = 0;
+      char name[10] = {0};
+      fread(&name_len, 1, 1, fp);
+      CU_ASSERT(name_len == 5 && fread(name, 1, name_len, fp) == 5);
+      CU_ASSERT(strcmp(name, batch_names[j]) == 0);
+    }
+  }
+  CU_ASSERT(fread(&rec, sizeof(rec), 1, fp) == 0);
+  fclose(fp);
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+  system("rm -rf test_trace");
+}
+
+void test_batch_create_and_delete(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  strcpy(disk_name, "test_disk");
+  fs.create_disk(disk_name);
+  fs.mount_disk(disk_name);
+  char names[3][10];
+  char* file_names[3];
+  int results[3];
+  for(int i=0;i<3;++i){
+    sprintf(names[i], "file%d", i);
+    file_names[i] = names[i];
+  }
+  // Test creating a batch of files
+  CU_ASSERT(fs.add_files_to_disk(file_names, 3, results) == 3);
+  CU_ASSERT(results[0] == 1 && results[1] == 1 && results[2] == 1);
+  CU_ASSERT(fs.open_file(names[2], 1) >= 0);
+  // Test batch with a duplicate name creates nothing
+  strcpy(names[0], "file3");
+  CU_ASSERT(fs.add_files_to_disk(file_names, 2, results) == 0);
+  CU_ASSERT(results[0] == -2 && results[1] == 0);
+  CU_ASSERT(fs.open_file(names[0], 1) == -1);
+  // Test batch delete with a missing name removes nothing
+  CU_ASSERT(fs.remove_files_from_disk(file_names, 3, results) == 0);
+  CU_ASSERT(results[0] == 0 && results[1] == -2 && results[2] == -2);
+  // Test deleting a batch of files
+  CU_ASSERT(fs.remove_files_from_disk(file_names+1, 2, results) == 2);
+  CU_ASSERT(fs.open_file(names[1], 1) == -1);
+  // Test freed memory is reused
+  CU_ASSERT(fs.add_file_to_disk(names[1]) == 1);
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+}
+
+void test_large_file_write(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  char file_name[10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_name, "file1");
+  fs.create_disk(disk_name);
+  fs.mount_disk(disk_name);
+  fs.add_file_to_disk(file_name);
+  // Test writing data spanning several blocks
+  int size = 3*BLOCK_SIZE+100;
+  char* line = (char*)malloc(size);
+  char* out = (char*)malloc(size);
+  for(int i=0;i<size;++i){
+    line[i] = 'a'+i%26;
+  }
+  int fd = fs.open_file(file_name, 2);
+  CU_ASSERT(fs.write_to_file(fd, line, size) == size);
+  CU_ASSERT(fs.get_file_size(fd) == size);
+  fs.close_file(fd);
+  fd = fs.open_file(file_name, 1);
+  bzero(out, size);
+  CU_ASSERT(fs.read_from_file(fd, out, size) == size);
+  CU_ASSERT(memcmp(out, line, size) == 0);
+  // Test reading into a smaller buffer
+  CU_ASSERT(fs.read_from_file(fd, out, 10) == 10);
+  fs.close_file(fd);
+  // Test writing past inode capacity stops at capacity
+  free(line);
+  size = default_geometry::max_inode_blocks*default_geometry::block_size+10;
+  line = (char*)calloc(size, 1);
+  memset(line, 'a', size);
+  fd = fs.open_file(file_name, 2);
+  CU_ASSERT(fs.write_to_file(fd, line, size) == default_geometry::max_inode_blocks*default_geometry::block_size);
+  fs.close_file(fd);
+  free(line);
+  free(out);
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+}
+
+void test_inode_cache(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  char file_name[10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_name, "file1");
+  fs.create_disk(disk_name);
+  fs.mount_disk(disk_name);
+  fs.add_file_to_disk(file_name);
+  int append_fd = fs.open_file(file_name, 3);
+  int read_fd = fs.open_file(file_name, 1);
+  // Test appends across block boundary reuse cached inode and allocate from memory, so nothing is read
+  char line[11];
+  strcpy(line, "0123456789");
+  struct fs_stats before = fs.get_stats();
+  for(int i=0;i<500;++i){
+    CU_ASSERT(fs.append_to_file(append_fd, line, 10) == 10);
+  }
+  struct fs_stats after = fs.get_stats();
+  CU_ASSERT(after.io[IO_READ_CALLS] == before.io[IO_READ_CALLS]);
+  // Test other descriptor sees appended data
+  CU_ASSERT(fs.get_file_size(read_fd) == 5000);
+  char out[5000];
+  CU_ASSERT(fs.read_from_file(read_fd, out, 5000) == 5000);
+  int same = 1;
+  for(int i=0;i<5000;++i){
+    if(out[i] != '0'+i%10){
+      same = 0;
+    }
+  }
+  CU_ASSERT(same);
+  // Test data is on disk after remount
+  fs.close_file(append_fd);
+  fs.close_file(read_fd);
+  fs.unmount_disk();
+  fs.mount_disk(disk_name);
+  read_fd = fs.open_file(file_name, 1);
+  CU_ASSERT(fs.get_file_size(read_fd) == 5000);
+  // Test deleting a file closes its descriptors
+  CU_ASSERT(fs.remove_file_from_disk(file_name) == 1);
+  CU_ASSERT(fs.close_file(read_fd) == 0);
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+}
+
+void test_sparse_file(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  char file_name[10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_name, "file1");
+  fs.create_disk(disk_name);
+  fs.mount_disk(disk_name);
+  fs.add_file_to_disk(file_name);
+  // Test zero blocks in a write become holes
+  int size = 4*BLOCK_SIZE;
+  char* line = (char*)calloc(size, 1);
+  char* out = (char*)malloc(size+10);
+  strcpy(line, "start");
+  strcpy(line+3*BLOCK_SIZE, "end");
+  int fd = fs.open_file(file_name, 2);
+  struct fs_stats before = fs.get_stats();
+  CU_ASSERT(fs.write_to_file(fd, line, size) == size);
+  struct fs_stats after = fs.get_stats();
+  CU_ASSERT(after.io[IO_ZERO_BLOCKS_SKIPPED]-before.io[IO_ZERO_BLOCKS_SKIPPED] == 2);
+  CU_ASSERT(after.io[IO_BLOCK_SCANS]-before.io[IO_BLOCK_SCANS] == 1);
+  memset(out, 1, size);
+  CU_ASSERT(fs.read_from_file(fd, out, size) == size);
+  CU_ASSERT(memcmp(out, line, size) == 0);
+  // Test seeking data and holes
+  CU_ASSERT(fs.seek_data(fd, 0) == 0);
+  CU_ASSERT(fs.seek_hole(fd, 0) == BLOCK_SIZE);
+  CU_ASSERT(fs.seek_data(fd, BLOCK_SIZE+5) == 3*BLOCK_SIZE);
+  CU_ASSERT(fs.seek_hole(fd, 3*BLOCK_SIZE) == size);
+  CU_ASSERT(fs.seek_data(fd, size) == -1);
+  CU_ASSERT(fs.seek_hole(fd, size) == -1);
+  fs.close_file(fd);
+  // Test appending zeroes then data fills in hole at tail
+  fd = fs.open_file(file_name, 3);
+  char zeros[5] = {0};
+  CU_ASSERT(fs.append_to_file(fd, zeros, 5) == 5);
+  CU_ASSERT(fs.seek_hole(fd, size) == size);
+  char tail[4];
+  strcpy(tail, "abc");
+  CU_ASSERT(fs.append_to_file(fd, tail, 3) == 3);
+  CU_ASSERT(fs.get_file_size(fd) == size+8);
+  CU_ASSERT(fs.read_from_file(fd, out, size+10) == size+8);
+  CU_ASSERT(memcmp(out+size, "\0\0\0\0\0abc", 8) == 0);
+  fs.close_file(fd);
+  // Test preallocating with zeroes takes no blocks
+  fd = fs.open_file(file_name, 2);
+  memset(line, 0, size);
+  before = fs.get_stats();
+  CU_ASSERT(fs.write_to_file(fd, line, size) == size);
+  after = fs.get_stats();
+  CU_ASSERT(after.io[IO_BLOCK_SCANS] == before.io[IO_BLOCK_SCANS]);
+  CU_ASSERT(fs.seek_data(fd, 0) == -1);
+  fs.close_file(fd);
+  free(line);
+  free(out);
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+}
+
+/*
+ * Function to check a write that finds the disk full leaves its file readable and allocation map intact.
+ */
+void check_disk_full(int disk_layout){
+  typedef disk_geometry<8*1024*1024, 12, 64, 100, 2048> SmallGeometry;
+  BasicFileSystem<SmallGeometry, ram_storage> fs;
+  char disk_name[10];
+  char file_name[10];
+  strcpy(disk_name, "test_disk");
+  CU_ASSERT(fs.create_disk(disk_name, disk_layout) == 1);
+  fs.mount_disk(disk_name);
+  int size = SmallGeometry::max_inode_blocks*BLOCK_SIZE;
+  char* line = (char*)malloc(size);
+  char* out = (char*)malloc(size);
+  memset(line, 'a', size);
+  // file0 starts with a hole, file1 with data
+  strcpy(file_name, "file0");
+  fs.add_file_to_disk(file_name);
+  int hole_fd = fs.open_file(file_name, 2);
+  memset(out, 0, BLOCK_SIZE);
+  CU_ASSERT(fs.write_to_file(hole_fd, out, BLOCK_SIZE) == BLOCK_SIZE);
+  strcpy(file_name, "file1");
+  fs.add_file_to_disk(file_name);
+  int data_fd = fs.open_file(file_name, 2);
+  CU_ASSERT(fs.write_to_file(data_fd, line, BLOCK_SIZE) == BLOCK_SIZE);
+  // Fill disk with further files a block at a time, until even cleaning finds no room
+  int fill_fd = -1;
+  for(int i=2;;++i){
+    snprintf(file_name, sizeof(file_name), "file%d", i);
+    CU_ASSERT(fs.add_file_to_disk(file_name) == 1);
+    fill_fd = fs.open_file(file_name, 3);
+    int count = 0;
+    while(count < SmallGeometry::max_inode_blocks && fs.append_to_file(fill_fd, line, BLOCK_SIZE) == BLOCK_SIZE){
+      ++count;
+    }
+    fs.close_file(fill_fd);
+    if(count < SmallGeometry::max_inode_blocks){
+      break;
+    }
+  }
+  int free_blocks = fs.get_free_block_count();
+  // Test overwriting a hole with data when no block is left keeps the hole
+  memset(line, 'b', BLOCK_SIZE);
+  CU_ASSERT(fs.write_to_file(hole_fd, line, BLOCK_SIZE) == 0);
+  CU_ASSERT(fs.get_file_size(hole_fd) == BLOCK_SIZE);
+  memset(out, 1, BLOCK_SIZE);
+  CU_ASSERT(fs.read_from_file(hole_fd, out, size) == BLOCK_SIZE);
+  CU_ASSERT(out[0] == 0 && memcmp(out, out+1, BLOCK_SIZE-1) == 0);
+  // Test overwriting data either succeeds in place or leaves old data
+  int res = fs.write_to_file(data_fd, line, BLOCK_SIZE);
+  CU_ASSERT(res == 0 || res == BLOCK_SIZE);
+  CU_ASSERT(fs.get_file_size(data_fd) == BLOCK_SIZE);
+  CU_ASSERT(fs.read_from_file(data_fd, out, size) == BLOCK_SIZE);
+  CU_ASSERT(out[0] == (res == 0 ? 'a' : 'b') && memcmp(out, out+1, BLOCK_SIZE-1) == 0);
+  CU_ASSERT(fs.get_free_block_count() == free_blocks);
+  fs.close_file(hole_fd);
+  fs.close_file(data_fd);
+  // Test allocation map rebuilt at mount agrees
+  fs.unmount_disk();
+  fs.mount_disk(disk_name);
+  CU_ASSERT(fs.get_free_block_count() == free_blocks);
+  fs.unmount_disk();
+  free(line);
+  free(out);
+  ram_storage::remove_disk(disk_name);
+}
+
+void test_disk_full(void){
+  check_disk_full(LAYOUT_BLOCK);
+  check_disk_full(LAYOUT_LOG);
+}
+
+void test_append_stream(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  char file_name[10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_name, "file1");
+  fs.create_disk(disk_name);
+  fs.mount_disk(disk_name);
+  fs.add_file_to_disk(file_name);
+  int fd = fs.open_file(file_name, 3);
+  // Test records from several producers all arrive, in order per producer
+  {
+    AppendStream<RamFileSystem> stream(fs, fd, 1024, 5);
+    vector<thread> producers;
+    for(int t=0;t<4;++t){
+      producers.push_back(thread([&stream, t]{
+        char record[17];
+        for(int i=0;i<1000;++i){
+          sprintf(record, "%d %014d", t, i);
+          stream.append(record, 16);
+        }
+      }));
+    }
+    for(int t=0;t<4;++t){
+      producers[t].join();
+    }
+    CU_ASSERT(stream.flush() == 0);
+    lock_guard<recursive_mutex> guard(fs.io_lock());
+    CU_ASSERT(fs.get_file_size(fd) == 64000);
+  }
+  char* out = (char*)malloc(64000);
+  CU_ASSERT(fs.read_from_file(fd, out, 64000) == 64000);
+  int next[4] = {0, 0, 0, 0};
+  int ordered = 1;
+  for(int i=0;i<4000;++i){
+    int t, n;
+    sscanf(out+i*16, "%1d %14d", &t, &n);
+    if(t < 0 || t > 3 || n != next[t]){
+      ordered = 0;
+      break;
+    }
+    ++next[t];
+  }
+  CU_ASSERT(ordered);
+  free(out);
+  // Test destructor writes data which was not flushed
+  {
+    AppendStream<RamFileSystem> stream(fs, fd, 1024, 1000);
+    stream.append("tail", 4);
+  }
+  CU_ASSERT(fs.get_file_size(fd) == 64004);
+  fs.close_file(fd);
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+}
+
+void test_durability_modes(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  char file_name[10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_name, "file1");
+  fs.create_disk(disk_name);
+  // Test nothing is synced without fsync in default mode
+  fs.mount_disk(disk_name);
+  fs.add_file_to_disk(file_name);
+  int fd = fs.open_file(file_name, 2);
+  fs.write_to_file(fd, (char*)"data", 4);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 0);
+  CU_ASSERT(fs.fsync(fd) == 0);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 1);
+  // Test fsync with nothing written does not sync again
+  CU_ASSERT(fs.fsync(fd) == 0);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 1);
+  CU_ASSERT(fs.fsync(fd+1) == -1);
+  fs.close_file(fd);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 1);
+  fs.unmount_disk();
+  // Test close syncs in on close mode
+  fs.mount_disk(disk_name, DURABILITY_ON_CLOSE);
+  fd = fs.open_file(file_name, 3);
+  fs.append_to_file(fd, (char*)"more", 4);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 1);
+  fs.close_file(fd);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 2);
+  fs.unmount_disk();
+  // Test every write syncs in per op mode
+  fs.mount_disk(disk_name, DURABILITY_PER_OP);
+  fd = fs.open_file(file_name, 3);
+  fs.append_to_file(fd, (char*)"more", 4);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 3);
+  fs.append_to_file(fd, (char*)"more", 4);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 4);
+  fs.close_file(fd);
+  fs.unmount_disk();
+  // Test background thread syncs in periodic mode
+  fs.mount_disk(disk_name, DURABILITY_PERIODIC, 5);
+  fd = fs.open_file(file_name, 3);
+  fs.append_to_file(fd, (char*)"more", 4);
+  for(int i=0;i<200&&fs.get_stats().io[IO_SYNC_CALLS]<5;++i){
+    this_thread::sleep_for(chrono::milliseconds(5));
+  }
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] == 5);
+  fs.close_file(fd);
+  CU_ASSERT(fs.unmount_disk() == 0);
+  fs.mount_disk(disk_name);
+  fd = fs.open_file(file_name, 1);
+  CU_ASSERT(fs.get_file_size(fd) == 20);
+  fs.close_file(fd);
+  fs.unmount_disk();
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+}
+
+/*
+ * Function to read block positions of a file's inode straight from a disk image.
+ */
+vector<int> read_block_positions(const char* disk_name, int inode_pos){
+  vector<int> positions;
+  FILE* fp = fopen(disk_name, "rb");
+  fseek(fp, (long)(inode_pos-1)*BLOCK_SIZE, SEEK_SET);
+  int count;
+  fread(&count, sizeof(count), 1, fp);
+  for(int i=0;i<count;++i){
+    struct inode_data data;
+    fread(&data, sizeof(data), 1, fp);
+    positions.push_back(data.block_pos);
+  }
+  fclose(fp);
+  return positions;
+}
+
+void test_alloc_groups(void){
+  FileSystem fs;
+  char disk_name[10];
+  char file_names[2][10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_names[0], "file1");
+  strcpy(file_names[1], "file2");
+  fs.create_disk(disk_name);
+  fs.mount_disk(disk_name);
+  int free_blocks = fs.get_free_block_count();
+  // Test files created by different threads go to different groups
+  vector<thread> threads;
+  for(int t=0;t<2;++t){
+    threads.push_back(thread([&fs, &file_names, t]{
+      lock_guard<recursive_mutex> guard(fs.io_lock());
+      fs.add_file_to_disk(file_names[t]);
+    }));
+  }
+  for(int t=0;t<2;++t){
+    threads[t].join();
+  }
+  vector<struct file_info> files = fs.get_file_list();
+  int group_size = (INODE_END-SUPER_END+ALLOC_GROUPS-1)/ALLOC_GROUPS;
+  CU_ASSERT(abs(files[0].inode_pos-files[1].inode_pos) >= group_size);
+  CU_ASSERT(fs.remove_file_from_disk(file_names[0]) == 1);
+  CU_ASSERT(fs.remove_file_from_disk(file_names[1]) == 1);
+  // Test interleaved appends keep each file's blocks contiguous
+  CU_ASSERT(fs.add_file_to_disk(file_names[0]) == 1);
+  CU_ASSERT(fs.add_file_to_disk(file_names[1]) == 1);
+  int fds[2];
+  fds[0] = fs.open_file(file_names[0], 3);
+  fds[1] = fs.open_file(file_names[1], 3);
+  char line[BLOCK_SIZE];
+  memset(line, 'a', BLOCK_SIZE);
+  for(int i=0;i<3;++i){
+    CU_ASSERT(fs.append_to_file(fds[0], line, BLOCK_SIZE) == BLOCK_SIZE);
+    CU_ASSERT(fs.append_to_file(fds[1], line, BLOCK_SIZE) == BLOCK_SIZE);
+  }
+  fs.close_file(fds[0]);
+  fs.close_file(fds[1]);
+  CU_ASSERT(fs.get_free_block_count() == free_blocks-6);
+  // Test free space is rebuilt from inodes at mount
+  files = fs.get_file_list();
+  fs.unmount_disk();
+  for(int f=0;f<2;++f){
+    vector<int> positions = read_block_positions(disk_name, files[f].inode_pos);
+    CU_ASSERT(positions.size() == 3);
+    for(int i=1;i<positions.size();++i){
+      CU_ASSERT(positions[i] == positions[i-1]+1);
+    }
+  }
+  fs.mount_disk(disk_name);
+  CU_ASSERT(fs.get_free_block_count() == free_blocks-6);
+  CU_ASSERT(fs.remove_file_from_disk(file_names[0]) == 1);
+  CU_ASSERT(fs.remove_file_from_disk(file_names[1]) == 1);
+  CU_ASSERT(fs.get_free_block_count() == free_blocks);
+  fs.unmount_disk();
+  // Delete disk
+  system("rm -rf test_disk");
+}
+
+void test_log_layout(void){
+  typedef BasicFileSystem<disk_geometry<8*1024*1024, 12, 64, 100, 2048>, ram_storage> SmallFileSystem;
+  SmallFileSystem fs;
+  char disk_name[10];
+  char file_names[2][10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_names[0], "file1");
+  strcpy(file_names[1], "file2");
+  CU_ASSERT(fs.create_disk(disk_name, LAYOUT_LOG) == 1);
+  CU_ASSERT(fs.mount_disk(disk_name) == 0);
+  CU_ASSERT(fs.get_layout() == LAYOUT_LOG);
+  CU_ASSERT(fs.add_file_to_disk(file_names[0]) == 1);
+  CU_ASSERT(fs.add_file_to_disk(file_names[1]) == 1);
+  // Test small appends and rewrites read back, while cleaner reclaims overwritten segments
+  int size = 100*BLOCK_SIZE;
+  char* line = (char*)malloc(size);
+  char* out = (char*)malloc(size);
+  for(int i=0;i<size;++i){
+    line[i] = 'a'+i%26;
+  }
+  int fd = fs.open_file(file_names[0], 3);
+  for(int i=0;i<1000;++i){
+    CU_ASSERT(fs.append_to_file(fd, line+i*10, 10) == 10);
+  }
+  fs.close_file(fd);
+  fd = fs.open_file(file_names[1], 2);
+  for(int i=0;i<40;++i){
+    line[0] = 'A'+i%26;
+    CU_ASSERT(fs.write_to_file(fd, line, size) == size);
+  }
+  fs.close_file(fd);
+  CU_ASSERT(fs.get_stats().io[IO_SEGMENTS_CLEANED] > 0);
+  fd = fs.open_file(file_names[0], 1);
+  CU_ASSERT(fs.read_from_file(fd, out, size) == 10000);
+  CU_ASSERT(memcmp(out+1, line+1, 9999) == 0);
+  fs.close_file(fd);
+  // Test files are found through inode map after remount
+  CU_ASSERT(fs.unmount_disk() == 0);
+  CU_ASSERT(fs.mount_disk(disk_name) == 0);
+  CU_ASSERT(fs.get_layout() == LAYOUT_LOG);
+  fd = fs.open_file(file_names[1], 1);
+  CU_ASSERT(fs.read_from_file(fd, out, size) == size);
+  CU_ASSERT(memcmp(out, line, size) == 0);
+  fs.close_file(fd);
+  fd = fs.open_file(file_names[0], 1);
+  CU_ASSERT(fs.read_from_file(fd, out, size) == 10000);
+  CU_ASSERT(memcmp(out+1, line+1, 9999) == 0);
+  fs.close_file(fd);
+  // Test deleting releases all live blocks
+  CU_ASSERT(fs.remove_file_from_disk(file_names[0]) == 1);
+  CU_ASSERT(fs.remove_file_from_disk(file_names[1]) == 1);
+  CU_ASSERT(fs.get_free_block_count() == 2048-100);
+  fs.unmount_disk();
+  free(line);
+  free(out);
+  ram_storage::remove_disk(disk_name);
+  // Test default layout and geometries too small for log layout
+  CU_ASSERT(fs.create_disk(disk_name) == 1);
+  fs.mount_disk(disk_name);
+  CU_ASSERT(fs.get_layout() == LAYOUT_BLOCK);
+  fs.unmount_disk();
+  ram_storage::remove_disk(disk_name);
+  CU_ASSERT(!(BasicFileSystem<disk_geometry<4*1024*1024, 10, 4, 100, 4096>, ram_storage>::log_layout_fits));
+}
+
+void test_log_checkpoint_slots(void){
+  typedef BasicFileSystem<disk_geometry<8*1024*1024, 12, 64, 100, 2048>, stdio_storage> SmallFileSystem;
+  SmallFileSystem fs;
+  char disk_name[10];
+  char crash_name[20];
+  char file_names[2][10];
+  strcpy(disk_name, "test_disk");
+  strcpy(crash_name, "test_disk_crash");
+  strcpy(file_names[0], "file1");
+  strcpy(file_names[1], "file2");
+  fs.create_disk(disk_name, LAYOUT_LOG);
+  // Periodic mode with a long interval, so only fsync checkpoints
+  fs.mount_disk(disk_name, DURABILITY_PERIODIC, 3600*1000);
+  // Each fsync checkpoints to the slot not holding the last checkpoint, syncing before and after the header
+  fs.add_file_to_disk(file_names[0]);
+  int fd = fs.open_file(file_names[0], 2);
+  fs.write_to_file(fd, (char*)"first", 5);
+  CU_ASSERT(fs.fsync(fd) == 0);
+  CU_ASSERT(fs.get_stats().io[IO_SYNC_CALLS] >= 2);
+  fs.close_file(fd);
+  fs.add_file_to_disk(file_names[1]);
+  fd = fs.open_file(file_names[1], 2);
+  fs.write_to_file(fd, (char*)"second", 6);
+  CU_ASSERT(fs.fsync(fd) == 0);
+  fs.close_file(fd);
+  // Copy image as a crash would leave it, before unmount checkpoints again
+  system("cp --sparse=always test_disk test_disk_crash");
+  fs.unmount_disk();
+  int disk_fd = open(crash_name, O_RDWR);
+  struct log_header headers[CHECKPOINT_SLOTS];
+  for(int slot=0;slot<CHECKPOINT_SLOTS;++slot){
+    pread(disk_fd, &headers[slot], sizeof(headers[slot]), SmallFileSystem::header_offset(slot));
+  }
+  int newest = SmallFileSystem::newest_checkpoint(headers);
+  CU_ASSERT(newest >= 0);
+  CU_ASSERT(headers[1-newest].magic == LOG_MAGIC && headers[1-newest].sequence == headers[newest].sequence-1);
+  // Test a torn newest header falls back to the checkpoint before it
+  memset(&headers[newest], 0, sizeof(headers[newest]));
+  pwrite(disk_fd, &headers[newest], sizeof(headers[newest]), SmallFileSystem::header_offset(newest));
+  close(disk_fd);
+  CU_ASSERT(fs.mount_disk(crash_name) == 0);
+  CU_ASSERT(fs.get_layout() == LAYOUT_LOG);
+  vector<struct file_info> files = fs.get_file_list();
+  CU_ASSERT(files.size() == 1 && strcmp(files[0].file_name, file_names[0]) == 0);
+  char out[10];
+  fd = fs.open_file(file_names[0], 1);
+  CU_ASSERT(fs.read_from_file(fd, out, 10) == 5 && memcmp(out, "first", 5) == 0);
+  fs.close_file(fd);
+  fs.unmount_disk();
+  // Test latest checkpoint has both files
+  fs.mount_disk(disk_name);
+  CU_ASSERT(fs.get_file_list().size() == 2);
+  fd = fs.open_file(file_names[1], 1);
+  CU_ASSERT(fs.read_from_file(fd, out, 10) == 6 && memcmp(out, "second", 6) == 0);
+  fs.close_file(fd);
+  fs.unmount_disk();
+  system("rm -rf test_disk test_disk_crash");
+}
+
+void test_search(void){
+  RamFileSystem fs;
+  char disk_name[10];
+  char file_names[3][10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_names[0], "file1");
+  strcpy(file_names[1], "file2");
+  strcpy(file_names[2], "file3");
+  fs.create_disk(disk_name);
+  fs.mount_disk(disk_name);
+  for(int f=0;f<3;++f){
+    fs.add_file_to_disk(file_names[f]);
+  }
+  // file1 has a match inside a block and one across a block boundary after a hole
+  int size = 3*BLOCK_SIZE;
+  char* line = (char*)calloc(size, 1);
+  memcpy(line+100, "needle", 6);
+  memcpy(line+2*BLOCK_SIZE-3, "needle", 6);
+  int fd = fs.open_file(file_names[0], 2);
+  fs.write_to_file(fd, line, size);
+  fs.close_file(fd);
+  // file2 has a match split over appends, file3 has none
+  fd = fs.open_file(file_names[1], 3);
+  fs.append_to_file(fd, (char*)"xxnee", 5);
+  fs.append_to_file(fd, (char*)"dlexxneedle", 11);
+  fs.close_file(fd);
+  fd = fs.open_file(file_names[2], 2);
+  fs.write_to_file(fd, (char*)"needl eedle", 11);
+  fs.close_file(fd);
+  // Test names and offsets, with one and several threads
+  for(int threads=1;threads<=4;threads+=3){
+    struct search_options options = {0, threads};
+    vector<struct search_result> res = fs.search("needle", options);
+    CU_ASSERT(res.size() == 2);
+    if(res.size() == 2){
+      CU_ASSERT(strcmp(res[0].file_name, "file1") == 0);
+      CU_ASSERT(res[0].offsets.size() == 2);
+      CU_ASSERT(res[0].offsets[0] == 100);
+      CU_ASSERT(res[0].offsets[1] == 2*BLOCK_SIZE-3);
+      CU_ASSERT(strcmp(res[1].file_name, "file2") == 0);
+      CU_ASSERT(res[1].offsets.size() == 2);
+      CU_ASSERT(res[1].offsets[0] == 2);
+      CU_ASSERT(res[1].offsets[1] == 10);
+    }
+  }
+  // Test match limit and patterns found nowhere
+  struct search_options options = {1, 0};
+  vector<struct search_result> res = fs.search("needle", options);
+  CU_ASSERT(res.size() == 2 && res[0].offsets.size() == 1 && res[1].offsets.size() == 1);
+  CU_ASSERT(fs.search("haystack").empty());
+  CU_ASSERT(fs.search("").empty());
+  CU_ASSERT(fs.get_stats().ops[OP_SEARCH].count == 5);
+  free(line);
+  // Delete disk
+  ram_storage::remove_disk(disk_name);
+}
+
+template <class FS>
+void check_export_import(int disk_layout){
+  FS fs;
+  char disk_name[10];
+  char file_names[3][10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_names[0], "file1");
+  strcpy(file_names[1], "file2");
+  strcpy(file_names[2], "file3");
+  CU_ASSERT(fs.create_disk(disk_name, disk_layout) == 1);
+  fs.mount_disk(disk_name);
+  fs.add_file_to_disk(file_names[0]);
+  // file1 has a hole in its middle block
+  int size = 3*BLOCK_SIZE+100;
+  char* line = (char*)calloc(size, 1);
+  char* out = (char*)calloc(size+1, 1);
+  for(int i=0;i<size;++i){
+    line[i] = (i >= BLOCK_SIZE && i < 2*BLOCK_SIZE) ? 0 : 'a'+i%26;
+  }
+  int fd = fs.open_file(file_names[0], 2);
+  fs.write_to_file(fd, line, size);
+  // Test export to a host file, where holes are seeked over
+  FILE* host = tmpfile();
+  CU_ASSERT(fs.export_file(fd, fileno(host)) == size);
+  CU_ASSERT(pread(fileno(host), out, size+1, 0) == size);
+  CU_ASSERT(memcmp(out, line, size) == 0);
+  CU_ASSERT(fs.get_stats().io[IO_KERNEL_COPY_BYTES] == size-BLOCK_SIZE);
+  // Test export to a pipe, where holes are written as zeroes
+  int fds[2];
+  pipe(fds);
+  CU_ASSERT(fs.export_file(fd, fds[1]) == size);
+  close(fds[1]);
+  memset(out, 1, size);
+  int read_count = 0;
+  for(int res=1;res>0;read_count+=res){
+    res = read(fds[0], out+read_count, size-read_count);
+  }
+  close(fds[0]);
+  CU_ASSERT(read_count == size);
+  CU_ASSERT(memcmp(out, line, size) == 0);
+  fs.close_file(fd);
+  CU_ASSERT(fs.export_file(fd, fileno(host)) == -1);
+  // Test import from a host file and from a pipe
+  lseek(fileno(host), 0, SEEK_SET);
+  CU_ASSERT(fs.import_file(fileno(host), file_names[1]) == size);
+  CU_ASSERT(fs.import_file(fileno(host), file_names[1]) == -2);
+  fclose(host);
+  pipe(fds);
+  write(fds[1], "pipe data", 9);
+  close(fds[1]);
+  CU_ASSERT(fs.import_file(fds[0], file_names[2]) == 9);
+  close(fds[0]);
+  CU_ASSERT(fs.get_stats().ops[OP_EXPORT].count == 3);
+  CU_ASSERT(fs.get_stats().ops[OP_IMPORT].count == 3);
+  // Test imported files are kept across remount
+  fs.unmount_disk();
+  fs.mount_disk(disk_name);
+  fd = fs.open_file(file_names[1], 1);
+  CU_ASSERT(fs.get_file_size(fd) == size);
+  memset(out, 1, size);
+  CU_ASSERT(fs.read_from_file(fd, out, size) == size);
+  CU_ASSERT(memcmp(out, line, size) == 0);
+  fs.close_file(fd);
+  fd = fs.open_file(file_names[2], 1);
+  CU_ASSERT(fs.read_from_file(fd, out, size) == 9);
+  CU_ASSERT(memcmp(out, "pipe data", 9) == 0);
+  fs.close_file(fd);
+  fs.unmount_disk();
+  free(line);
+  free(out);
+}
+
+void test_export_import(void){
+  check_export_import<FileSystem>(LAYOUT_BLOCK);
+  system("rm -rf test_disk");
+  check_export_import<BasicFileSystem<disk_geometry<8*1024*1024, 12, 64, 100, 2048>, stdio_storage> >(LAYOUT_LOG);
+  system("rm -rf test_disk");
+}
+
+template <class Storage>
+void check_storage_backend(){
+  typedef BasicFileSystem<disk_geometry<4*1024*1024, 10, 4, 100, 4096>, Storage> SmallFileSystem;
+  SmallFileSystem fs;
+  char disk_name[10];
+  char file_name[10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_name, "file1");
+  CU_ASSERT(fs.create_disk(disk_name) == 1);
+  CU_ASSERT(fs.create_disk(disk_name) == 0);
+  CU_ASSERT(fs.mount_disk(disk_name) == 0);
+  CU_ASSERT(fs.add_file_to_disk(file_name) == 1);
+  char line[5000];
+  for(int i=0;i<5000;++i){
+    line[i] = 'a'+i%26;
+  }
+  int fd = fs.open_file(file_name, 2);
+  CU_ASSERT(fs.write_to_file(fd, line, 5000) == 5000);
+  CU_ASSERT(fs.fsync(fd) == 0);
+  fs.close_file(fd);
+  // Test data is kept across remount
+  CU_ASSERT(fs.unmount_disk() == 0);
+  CU_ASSERT(fs.unmount_disk() == -1);
+  CU_ASSERT(fs.mount_disk(disk_name) == 0);
+  char out[5000];
+  fd = fs.open_file(file_name, 1);
+  CU_ASSERT(fs.read_from_file(fd, out, 5000) == 5000);
+  CU_ASSERT(memcmp(out, line, 5000) == 0);
+  fs.close_file(fd);
+  // Test search reads blocks whether or not disk is mapped
+  vector<struct search_result> res = fs.search("xyzab");
+  CU_ASSERT(res.size() == 1 && res[0].offsets.size() == 5000/26);
+  // Test export and import whether or not disk has a file descriptor
+  FILE* host = tmpfile();
+  fd = fs.open_file(file_name, 1);
+  CU_ASSERT(fs.export_file(fd, fileno(host)) == 5000);
+  fs.close_file(fd);
+  lseek(fileno(host), 0, SEEK_SET);
+  CU_ASSERT(fs.import_file(fileno(host), (char*)"file2") == 5000);
+  fclose(host);
+  fd = fs.open_file((char*)"file2", 1);
+  memset(out, 0, 5000);
+  CU_ASSERT(fs.read_from_file(fd, out, 5000) == 5000);
+  CU_ASSERT(memcmp(out, line, 5000) == 0);
+  fs.close_file(fd);
+  fs.unmount_disk();
+}
+
+void test_storage_backends(void){
+  check_storage_backend<stdio_storage>();
+  system("rm -rf test_disk");
+  check_storage_backend<pread_storage>();
+  system("rm -rf test_disk");
+  check_storage_backend<mmap_storage>();
+  system("rm -rf test_disk");
+  check_storage_backend<ram_storage>();
+  CU_ASSERT(access("test_disk", F_OK) != 0);
+  CU_ASSERT(ram_storage::remove_disk("test_disk") == 0);
+  CU_ASSERT(ram_storage::remove_disk("test_disk") == -1);
+}
+
+/*
+ * Function to run checker on a mapped image without its report going to output.
+ */
+int run_checker(struct check_state& state, int do_repair){
+  ofstream null_stream;
+  streambuf* cout_buf = cout.rdbuf(null_stream.rdbuf());
+  int res = check_image(state, do_repair);
+  cout.rdbuf(cout_buf);
+  return res;
+}
+
+void check_fsck(int disk_layout){
+  FileSystem fs;
+  char disk_name[10];
+  char file_names[3][10];
+  strcpy(disk_name, "test_disk");
+  strcpy(file_names[0], "file1");
+  strcpy(file_names[1], "file2");
+  strcpy(file_names[2], "file3");
+  fs.create_disk(disk_name, disk_layout);
+  fs.mount_disk(disk_name);
+  char line[2*BLOCK_SIZE];
+  memset(line, 'a', sizeof(line));
+  for(int f=0;f<3;++f){
+    fs.add_file_to_disk(file_names[f]);
+    int fd = fs.open_file(file_names[f], 2);
+    line[0] = '1'+f;
+    fs.write_to_file(fd, line, sizeof(line));
+    fs.close_file(fd);
+  }
+  fs.unmount_disk();
+  int disk_fd = open(disk_name, O_RDWR);
+  struct check_state state;
+  state.thread_count = 2;
+  state.image = (char*)mmap(NULL, Geometry::disk_size, PROT_READ|PROT_WRITE, MAP_SHARED, disk_fd, 0);
+  close(disk_fd);
+  CU_ASSERT(run_checker(state, 0) == FSCK_OK);
+  CU_ASSERT(state.layout == disk_layout);
+  CU_ASSERT(state.files.size() == 3 && state.used_blocks == ((disk_layout == LAYOUT_LOG) ? 9 : 6));
+
+  // Share file1's first block with file2
+  struct inode_data* maps[2];
+  for(int f=0;f<2;++f){
+    maps[f] = (struct inode_data*)(block_ptr(state, inode_block(state, state.files[f].inode_pos))+sizeof(int));
+  }
+  maps[1][0].block_pos = maps[0][0].block_pos;
+  // Give file3 a name without terminator, leaving its inode an orphan
+  memset(state.file_list+sizeof(int)+2*sizeof(struct file_info), 'x', FILE_NAME_SIZE);
+  // Mark an unused inode in use
+  int empty_inode = Layout::inode_count-1;
+  int in_use = 1;
+  if(disk_layout == LAYOUT_LOG){
+    memcpy(block_ptr(state, Layout::imap_slot_start(state.slot))+empty_inode*sizeof(int), &maps[0][0].block_pos, sizeof(int));
+  }else{
+    memcpy(block_ptr(state, Geometry::inode_start+empty_inode), &in_use, sizeof(in_use));
+    // Mark an unused block in use
+    memcpy(block_ptr(state, Geometry::block_end), &in_use, sizeof(in_use));
+  }
+  CU_ASSERT(run_checker(state, 0) == FSCK_UNCORRECTED);
+  CU_ASSERT(state.bad_names == 1);
+  CU_ASSERT(state.double_blocks == 1);
+  CU_ASSERT(state.orphan_inodes == 2);
+  // In block layout, file2's own first block and file3's blocks are leaked too
+  CU_ASSERT(state.leaked_blocks == ((disk_layout == LAYOUT_LOG) ? 0 : 4));
+
+  // Test repair leaves a clean image
+  CU_ASSERT(run_checker(state, 1) == FSCK_CORRECTED);
+  CU_ASSERT(run_checker(state, 0) == FSCK_OK);
+  CU_ASSERT(state.files.size() == 2);
+  munmap(state.image, Geometry::disk_size);
+
+  // Test repaired disk mounts, file1 is intact and file2 no longer shares its block
+  fs.mount_disk(disk_name);
+  CU_ASSERT(fs.get_file_list().size() == 2);
+  char out[2*BLOCK_SIZE];
+  int fd = fs.open_file(file_names[0], 1);
+  line[0] = '1';
+  CU_ASSERT(fs.read_from_file(fd, out, sizeof(out)) == sizeof(out));
+  CU_ASSERT(memcmp(out, line, sizeof(out)) == 0);
+  fs.close_file(fd);
+  fd = fs.open_file(file_names[1], 2);
+  memset(line, 'b', sizeof(line));
+  CU_ASSERT(fs.write_to_file(fd, line, sizeof(line)) == sizeof(line));
+  fs.close_file(fd);
+  fd = fs.open_file(file_names[0], 1);
+  CU_ASSERT(fs.read_from_file(fd, out, 1) == 1 && out[0] == '1');
+  fs.close_file(fd);
+  fs.unmount_disk();
+  system("rm -rf test_disk");
+}
+
+void test_fsck(void){
+  check_fsck(LAYOUT_BLOCK);
+  check_fsck(LAYOUT_LOG);
+}
+
+void test_server(void){
+  char disk_name[20];
+  char socket_name[20];
+  char file_name[10];
+  strcpy(disk_name, "test_disk_server");
+  strcpy(socket_name, "test_server.sock");
+  strcpy(file_name, "file1");
+  // Serve disk mounted on server file system from another thread
+  CU_ASSERT(fs.create_disk(disk_name) == 1);
+  CU_ASSERT(fs.mount_disk(disk_name) == 0);
+  int listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_name);
+  unlink(socket_name);
+  CU_ASSERT(bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  CU_ASSERT(listen(listen_sock, 16) == 0);
+  fcntl(listen_sock, F_SETFL, O_NONBLOCK);
+  running = 1;
+  thread server(serve, listen_sock);
+
+  FsClient client;
+  CU_ASSERT(client.connect_server(socket_name) == 0);
+  CU_ASSERT(client.add_file_to_disk(file_name) == 1);
+  CU_ASSERT(client.add_file_to_disk(file_name) == 0);
+  int size = 100000;
+  vector<char> data(size);
+  for(int i=0;i<size;++i){
+    data[i] = 'a'+i%26;
+  }
+  int fd = client.open_file(file_name, 2);
+  CU_ASSERT(fd >= 0);
+  CU_ASSERT(client.write_to_file(fd, data.data(), size) == size);
+  CU_ASSERT(client.close_file(fd) == 1);
+  // Test reading with data inline in response
+  fd = client.open_file(file_name, 1);
+  CU_ASSERT(client.get_file_size(fd) == size);
+  vector<char> buffer(size);
+  CU_ASSERT(client.read_from_file(fd, buffer.data(), size) == size);
+  CU_ASSERT(buffer == data);
+  // Test descriptor of another client is refused
+  FsClient other;
+  CU_ASSERT(other.connect_server(socket_name) == 0);
+  CU_ASSERT(other.read_from_file(fd, buffer.data(), size) == -3);
+  // Test shared memory created by server
+  CU_ASSERT(other.call(REQ_ATTACH_SHM, -1, 0, NULL, NULL, 0) == -1);
+  CU_ASSERT(client.attach_shm(1<<20) == 0);
+  fill(buffer.begin(), buffer.end(), 0);
+  CU_ASSERT(client.read_from_file(fd, buffer.data(), size) == size);
+  CU_ASSERT(buffer == data);
+  // Test ranges of shared memory are reused as responses arrive, while other requests still hold theirs
+  int shm_count = (1<<20)/size;
+  vector<vector<char> > outs(shm_count+5, vector<char>(size));
+  vector<unsigned int> shm_ids;
+  for(int i=0;i<outs.size();++i){
+    if(i == shm_count){
+      for(int k=0;k<5;++k){
+        struct client_response res;
+        CU_ASSERT(client.wait(shm_ids[k], res) == 0 && res.status == size && res.data.empty());
+      }
+    }
+    shm_ids.push_back(client.submit(REQ_READ, fd, 0, NULL, outs[i].data(), size));
+  }
+  for(int i=5;i<outs.size();++i){
+    struct client_response res;
+    CU_ASSERT(client.wait(shm_ids[i], res) == 0 && res.status == size && res.data.empty());
+  }
+  for(int i=0;i<outs.size();++i){
+    CU_ASSERT(outs[i] == data);
+  }
+  CU_ASSERT(client.get_shm_fallbacks() == 0);
+  // Test a payload is sent inline once shared memory is full
+  shm_ids.clear();
+  for(int i=0;i<=shm_count;++i){
+    shm_ids.push_back(client.submit(REQ_READ, fd, 0, NULL, outs[i].data(), size));
+  }
+  for(int i=0;i<=shm_count;++i){
+    struct client_response res;
+    CU_ASSERT(client.wait(shm_ids[i], res) == 0 && res.status == size);
+    CU_ASSERT(res.data.empty() == (i < shm_count));
+  }
+  CU_ASSERT(client.get_shm_fallbacks() == 1);
+  // Test pipelined reads whose responses exceed per client buffer
+  int count = 2*(MAX_CLIENT_BUFFER)/(MAX_REQUEST_DATA)+1;
+  vector<unsigned int> ids;
+  for(int i=0;i<count;++i){
+    ids.push_back(client.submit(REQ_READ, fd, 0, NULL, buffer.data(), MAX_REQUEST_DATA));
+  }
+  for(int i=count-1;i>=0;--i){
+    struct client_response res;
+    CU_ASSERT(client.wait(ids[i], res) == 0);
+    CU_ASSERT(res.status == size);
+    CU_ASSERT(res.data.size() == size && memcmp(res.data.data(), data.data(), size) == 0);
+  }
+  // Test pipelined creates and deletes run as batches
+  unsigned int create_id = client.submit(REQ_CREATE, -1, 0, "file2", NULL, 0);
+  unsigned int delete_id = client.submit(REQ_DELETE, -1, 0, file_name, NULL, 0);
+  struct client_response res;
+  CU_ASSERT(client.wait(delete_id, res) == 0 && res.status == 1);
+  CU_ASSERT(client.wait(create_id, res) == 0 && res.status == 1);
+  CU_ASSERT(client.open_file(file_name, 1) == -1);
+  client.disconnect();
+  other.disconnect();
+
+  running = 0;
+  server.join();
+  close(listen_sock);
+  unlink(socket_name);
+  fs.unmount_disk();
+  // Delete disk
+  system("rm -rf test_disk_server");
+}
+
 int main(){
   CU_pSuite pSuite = NULL;
 
@@ -188,7 +1277,24 @@ int main(){
   || (NULL == CU_add_test(pSuite, "test deleting file", test_delete_file))
   || (NULL == CU_add_test(pSuite, "test opening and closing file", test_file_open_and_close))
   || (NULL == CU_add_test(pSuite, "test writing file", test_file_write))
-  || (NULL == CU_add_test(pSuite, "test appending file", test_file_append))){
+  || (NULL == CU_add_test(pSuite, "test appending file", test_file_append))
+  || (NULL == CU_add_test(pSuite, "test stats", test_stats))
+  || (NULL == CU_add_test(pSuite, "test tracing", test_trace))
+  || (NULL == CU_add_test(pSuite, "test batch creating and deleting files", test_batch_create_and_delete))
+  || (NULL == CU_add_test(pSuite, "test writing large file", test_large_file_write))
+  || (NULL == CU_add_test(pSuite, "test inode cache", test_inode_cache))
+  || (NULL == CU_add_test(pSuite, "test storage backends", test_storage_backends))
+  || (NULL == CU_add_test(pSuite, "test sparse file", test_sparse_file))
+  || (NULL == CU_add_test(pSuite, "test disk full", test_disk_full))
+  || (NULL == CU_add_test(pSuite, "test append stream", test_append_stream))
+  || (NULL == CU_add_test(pSuite, "test durability modes", test_durability_modes))
+  || (NULL == CU_add_test(pSuite, "test allocation groups", test_alloc_groups))
+  || (NULL == CU_add_test(pSuite, "test log layout", test_log_layout))
+  || (NULL == CU_add_test(pSuite, "test log checkpoint slots", test_log_checkpoint_slots))
+  || (NULL == CU_add_test(pSuite, "test search", test_search))
+  || (NULL == CU_add_test(pSuite, "test export and import", test_export_import))
+  || (NULL == CU_add_test(pSuite, "test fsck", test_fsck))
+  || (NULL == CU_add_test(pSuite, "test server", test_server))){
     CU_cleanup_registry();
     return CU_get_error();
   }